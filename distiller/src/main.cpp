@@ -1,18 +1,22 @@
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
+#include <thread>
 #include <unordered_map>
-#include <fstream>
+#include <vector>
 
 #include "llvm/ADT/APSInt.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
@@ -20,6 +24,10 @@
 #include "llvm/Support/raw_ostream.h"
 
 #include "dfa.h"
+#include "distilled_graph.h"
+#include "kernel_module.h"
+#include "stream_intrinsics.h"
+#include "work_stealing_pool.h"
 
 using namespace llvm;
 using namespace analysis;
@@ -52,104 +60,157 @@ static cl::opt<std::string> out_filename {
     cl::Required,
     cl::cat{balance_cat}};
 
-static llvm::Function *SB_CONFIG;
-static llvm::Function *SB_WAIT;
-static llvm::Function *SB_MEM_PORT_STREAM;
-static llvm::Function *SB_CONSTANT;
-static llvm::Function *SB_PORT_MEM_STREAM;
-static llvm::Function *SB_DISCARD;
+enum class OutputFormat { Binary, CSV };
 
-static std::ofstream out_file;
+static cl::opt<OutputFormat> out_format {
+    "format",
+    cl::desc{"Format of the distilled graph"},
+    cl::values(
+        clEnumValN(OutputFormat::Binary, "binary",
+            "Memory-mappable binary records (see distilled_graph.h)"),
+        clEnumValN(OutputFormat::CSV, "csv", "One text line per node")),
+    cl::init(OutputFormat::Binary),
+    cl::cat{balance_cat}};
 
-llvm::Function* getCalledFunction(llvm::CallSite cs) {
-    auto* calledValue = cs.getCalledValue()->stripPointerCasts();
-    return llvm::dyn_cast<llvm::Function>(calledValue);
-}
+static cl::opt<unsigned> num_jobs {
+    "jobs",
+    cl::desc{"Number of functions distilled concurrently"},
+    cl::init(std::max(1u, std::thread::hardware_concurrency())),
+    cl::cat{balance_cat}};
 
-const int ExtractConstant(const llvm::Value * val) {
-    if (auto* constant = llvm::dyn_cast<llvm::ConstantInt>(val)) {
-        return constant->getValue().getLimitedValue();
+static cl::list<std::string> entry_names {
+    "entry",
+    cl::desc{"Only distill the kernels called from this function "
+             "(default: all kernels of the module)"},
+    cl::value_desc{"function"},
+    cl::ZeroOrMore,
+    cl::cat{balance_cat}};
+
+static std::unique_ptr<softbrain::StreamIntrinsics> sb;
+
+// The distilled functions of the module, by their index in the graph.
+using KernelIndexMap = llvm::DenseMap<const llvm::Function*, uint32_t>;
+
+// Every intrinsic is recorded as its name followed by the values of its
+// reported arguments, e.g. `SB_CONSTANT,<port>,<nelems>`, or -1 for those
+// that are not constant. Calls of other kernels are recorded with the index
+// of the callee.
+void ProcessCall(softbrain::DistilledGraphWriter& graph,
+                 const KernelIndexMap& kernels,
+                 int bb_id, int inst_id, llvm::CallSite& cs) {
+    auto* intrinsic = sb->lookup(cs);
+    if (!intrinsic) {
+        auto* callee = llvm::dyn_cast<llvm::Function>(
+            cs.getCalledValue()->stripPointerCasts());
+        auto found = kernels.find(callee);
+        if (found != kernels.end()) {
+            graph.addNode(bb_id, inst_id, softbrain::distilled::kCall,
+                          {int64_t(found->second)});
+        }
+        return;
     }
-    return -1;
-}
 
-void ProcessCall(int bb_id, int inst_id, llvm::CallSite& cs) {
-    llvm::Function * func = getCalledFunction(cs);
-    if (func->isDeclaration()) return;
-
-    if (func == SB_CONFIG) {
-        out_file << bb_id << "," << inst_id << ","
-            << "SB_CONFIG"
-            << std::endl;
-    }
-    else if (func == SB_MEM_PORT_STREAM) {
-        out_file << bb_id << "," << inst_id << ","
-            << "SB_MEM_PORT_STREAM,"
-            /* << "port = " */ << ExtractConstant(cs.getArgument(4)) << ","
-            /* << "stride = " */ << ExtractConstant(cs.getArgument(1)) << ","
-            /* << "access_size = " */ << ExtractConstant(cs.getArgument(2)) << ","
-            /* << "nstrides = " */ << ExtractConstant(cs.getArgument(3))
-            << std::endl;
-    }
-    else if (func == SB_CONSTANT) {
-        out_file << bb_id << "," << inst_id << ","
-            << "SB_CONSTANT,"
-            /* << "port = " */ << ExtractConstant(cs.getArgument(0)) << ","
-            /* << "nelems = " */ << ExtractConstant(cs.getArgument(2))
-            << std::endl;
-    }
-    else if (func == SB_PORT_MEM_STREAM) {
-        out_file << bb_id << "," << inst_id << ","
-            << "SB_PORT_MEM_STREAM,"
-            /* << "port = " */ << ExtractConstant(cs.getArgument(0)) << ","
-            /* << "stride = " */ << ExtractConstant(cs.getArgument(1)) << ","
-            /* << "access_size = " */ << ExtractConstant(cs.getArgument(2)) << ","
-            /* << "nstrides = " */ << ExtractConstant(cs.getArgument(3))
-            << std::endl;
-    }
-    else if (func == SB_DISCARD) {
-        out_file << bb_id << "," << inst_id << ","
-            << "SB_DISCARD,"
-            /* << "port = " */ << ExtractConstant(cs.getArgument(0)) << ","
-            /* << "nelems = " */ << ExtractConstant(cs.getArgument(1))
-            << std::endl;
-    }
-    else if (func == SB_WAIT) {
-        out_file << bb_id << "," << inst_id << ","
-            << "SB_WAIT" << std::endl;
+    llvm::SmallVector<int64_t, 4> arguments;
+    for (unsigned index = 0; index < intrinsic->numArguments; ++index) {
+        auto value = softbrain::getConstantArgument(
+            cs, intrinsic->arguments[index].index);
+        arguments.push_back(int64_t(value.value_or(-1)));
     }
+    graph.addNode(bb_id, inst_id, intrinsic->name, arguments);
 }
 
-void ProcessInst(int bb_id, int inst_id, auto& i) {
+void ProcessInst(softbrain::DistilledGraphWriter& graph,
+                 const KernelIndexMap& kernels,
+                 int bb_id, int inst_id, auto& i) {
     llvm::CallSite cs(&i);
     if (cs.getInstruction()) {
-        ProcessCall(bb_id, inst_id, cs);
+        ProcessCall(graph, kernels, bb_id, inst_id, cs);
         return;
     }
 
 
 }
 
-void ProcessBasicBlock(BbIdMap& bb_id_map, auto * bb) {
+void ProcessBasicBlock(softbrain::DistilledGraphWriter& graph,
+                       const KernelIndexMap& kernels,
+                       BbIdMap& bb_id_map, auto * bb) {
     int bb_id = bb_id_map[bb];
     int inst_id = 0;
 
     for (auto& i : Forward::getInstructions(*bb)) {
-        ProcessInst(bb_id, inst_id++, i);
+        ProcessInst(graph, kernels, bb_id, inst_id++, i);
     }
 
-    int num_successors = 0;
-
+    llvm::SmallVector<uint32_t, 2> successors;
     for (auto* s : Forward::getSuccessors(*bb)) {
-        num_successors++;
+        successors.push_back(bb_id_map[s]);
     }
+    graph.addControl(bb_id, inst_id, successors);
 
-    out_file << bb_id << "," << inst_id << ",control,";
-    for (auto* s : Forward::getSuccessors(*bb)) {
-        out_file << bb_id_map[s] << ",";
+}
+
+// Blocks are numbered in reverse post order, which is also the order in
+// which they are written. Blocks that are unreachable from the entry are
+// left out.
+void DistillFunction(softbrain::DistilledGraphWriter& graph,
+                     const KernelIndexMap& kernels, llvm::Function& f) {
+    graph.addFunction(f.getName());
+
+    std::vector<llvm::BasicBlock*> blocks;
+    BbIdMap bb_id_map;
+    for (auto* bb : Forward::getFunctionTraversal(f)) {
+        bb_id_map[bb] = blocks.size();
+        blocks.push_back(bb);
     }
-    out_file << std::endl;
 
+    for (auto* bb : blocks) {
+        ProcessBasicBlock(graph, kernels, bb_id_map, bb);
+    }
+}
+
+// The kernels of a module are the functions that call a stream intrinsic,
+// directly or through the functions they call, in module order. The
+// intrinsics themselves are not kernels.
+std::vector<llvm::Function*> FindKernels(llvm::Module& module) {
+    llvm::DenseMap<llvm::Function*, std::vector<llvm::Function*>> callers;
+    WorkList<llvm::Function*> work;
+
+    for (auto& f : module) {
+        if (f.isDeclaration() || sb->lookup(&f)) {
+            continue;
+        }
+        for (auto& i : llvm::instructions(f)) {
+            llvm::CallSite cs(&i);
+            if (!cs.getInstruction()) {
+                continue;
+            }
+            if (sb->lookup(cs)) {
+                work.add(&f);
+            } else if (auto* callee = llvm::dyn_cast<llvm::Function>(
+                           cs.getCalledValue()->stripPointerCasts())) {
+                callers[callee].push_back(&f);
+            }
+        }
+    }
+
+    llvm::DenseSet<llvm::Function*> reaching;
+    while (!work.empty()) {
+        auto* f = work.take();
+        if (!reaching.insert(f).second) {
+            continue;
+        }
+        for (auto* caller : callers.lookup(f)) {
+            work.add(caller);
+        }
+    }
+
+    std::vector<llvm::Function*> kernels;
+    for (auto& f : module) {
+        if (reaching.count(&f)) {
+            kernels.push_back(&f);
+        }
+    }
+    return kernels;
 }
 
 int main(int argc, char **argv) {
@@ -158,14 +219,12 @@ int main(int argc, char **argv) {
     llvm_shutdown_obj shutdown;
     cl::HideUnrelatedOptions(balance_cat);
     cl::ParseCommandLineOptions(argc, argv);
-    int i = 0;
 
     // Construct an IR file from the filename passed on the command line.
     SMDiagnostic err;
     LLVMContext context;
-    std::unique_ptr<Module> module = llvm::parseIRFile(input_path.getValue(), err, context);
-
-    out_file.open(out_filename.getValue(), std::ios::trunc);
+    std::unique_ptr<Module> module = softbrain::loadKernelModule(
+        input_path.getValue(), entry_names, err, context);
 
     if (!module.get()) {
         errs() << "Error reading bitcode file: " << input_path << "\n";
@@ -173,61 +232,62 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    auto *main_func = module->getFunction("main");
-
-    if (!main_func) {
-        llvm::report_fatal_error("Unable to find main function.");
-    }
-
-    SB_CONFIG = module->getFunction("SB_CONFIG");
-    SB_WAIT = module->getFunction("SB_WAIT");
-    SB_MEM_PORT_STREAM = module->getFunction("SB_MEM_PORT_STREAM");
-    SB_CONSTANT = module->getFunction("SB_CONSTANT");
-    SB_PORT_MEM_STREAM = module->getFunction("SB_PORT_MEM_STREAM");
-    SB_DISCARD = module->getFunction("SB_DISCARD");
-
-    auto traversal = Forward::getFunctionTraversal(*main_func);
-    BasicBlockWorklist labeling_work(traversal.begin(), traversal.end());
-
-    BbIdMap bb_id_map;
-    std::set<llvm::BasicBlock*> bb_seen;
-
-    while (!labeling_work.empty()) {
-        auto* bb = labeling_work.take();
-
-        if (bb_seen.count(bb) > 0) {
-            continue;
+    for (auto& name : entry_names) {
+        if (!module->getFunction(name)) {
+            llvm::report_fatal_error(llvm::Twine{"Unable to find "} + name
+                + " function.");
         }
+    }
 
-        bb_id_map[bb] = i++;
-
-        for (auto* s : Forward::getSuccessors(*bb)) {
-            labeling_work.add(s);
-        }
+    sb = std::make_unique<softbrain::StreamIntrinsics>(*module);
 
-        bb_seen.insert(bb);
+    auto kernels = FindKernels(*module);
+    if (kernels.empty()) {
+        errs() << "warning: no function of " << input_path
+               << " calls a stream intrinsic\n";
     }
 
-    BasicBlockWorklist process_work(traversal.begin(), traversal.end());
-    bb_seen.clear();
-
-    while (!process_work.empty()) {
-        auto* bb = process_work.take();
+    KernelIndexMap kernel_indices;
+    for (auto* f : kernels) {
+        kernel_indices[f] = kernel_indices.size();
+    }
 
-        if (bb_seen.count(bb) > 0) {
-            continue;
+    // The IR is only read from here on, so every kernel is distilled into
+    // its own graph on a separate task. The graphs are joined in module
+    // order, so the output does not depend on the number of jobs.
+    std::vector<softbrain::DistilledGraphWriter> shards(kernels.size());
+    {
+        analysis::WorkStealingPool pool{num_jobs};
+        for (std::size_t index = 0; index < kernels.size(); ++index) {
+            pool.async([&shards, &kernels, &kernel_indices, index] {
+                DistillFunction(shards[index], kernel_indices, *kernels[index]);
+            });
         }
+        pool.wait();
+    }
 
-        ProcessBasicBlock(bb_id_map, bb);
-
-        for (auto* s : Forward::getSuccessors(*bb)) {
-            process_work.add(s);
-        }
+    softbrain::DistilledGraphWriter graph;
+    for (auto& shard : shards) {
+        graph.append(shard);
+    }
 
-        bb_seen.insert(bb);
+    std::error_code ec;
+    llvm::raw_fd_ostream out_file{out_filename.getValue(), ec,
+        out_format == OutputFormat::CSV ? llvm::sys::fs::OF_Text
+                                        : llvm::sys::fs::OF_None};
+    if (ec) {
+        llvm::report_fatal_error(llvm::Twine{"Unable to write "}
+            + out_filename.getValue() + ": " + ec.message());
     }
 
-    out_file.close();
+    switch (out_format) {
+    case OutputFormat::Binary:
+        graph.writeBinary(out_file);
+        break;
+    case OutputFormat::CSV:
+        graph.writeCSV(out_file);
+        break;
+    }
 
     return 0;
 }
@@ -3,9 +3,20 @@ from z3 import *
 
 from model import *
 
+import mmap
 import os
+import struct
 import subprocess
 
+# Record layouts of the binary distilled graph format. See
+# simple-analyzer/include/distilled_graph.h for a description.
+DISTILLED_MAGIC = b'BALDIST\x00'
+DISTILLED_VERSION = 2
+DISTILLED_HEADER = struct.Struct('<8s6I')
+DISTILLED_FUNCTION = struct.Struct('<4I')
+DISTILLED_BLOCK = struct.Struct('<4I')
+DISTILLED_NODE = struct.Struct('<4I4q')
+
 def CompileDot(dotfile, outdir='edits'):
     if not os.path.exists(outdir):
         os.mkdir(outdir)
@@ -19,12 +30,12 @@ def CompileDot(dotfile, outdir='edits'):
     ])
 
 class Analyzer():
-    def __init__(self, filename):
+    def __init__(self, filename, function='main'):
         self.filename = filename
         self.loop_trip_counts = {}
         self.cond_trip_counts = []
         self.constraints = []
-        self.nodes = self.BuildGraph(filename)
+        self.nodes = self.BuildGraph(filename, function)
         self.entry = self.nodes[0]
         self.exit = self.FindExit()
         self.edit = 0
@@ -239,71 +250,185 @@ class Analyzer():
         return int(num_iters)
 
     @staticmethod
-    def BuildNode(line):
-        parts = list(filter(
-            lambda p: len(p) > 0,
-            map(lambda p: p.strip(), line.split(','))))
+    def MakeNode(bb_id, inst_id, name, args):
+        """ Builds the node of one distilled record
 
-        bb_id = int(parts[0])
-        inst_id = int(parts[1])
+        For control nodes, args are the target basic blocks and for calls the
+        index of the called function. For intrinsics, they are the reported
+        arguments in the order of the distiller.
+        """
 
-        if parts[2] == 'control':
-            return ControlNode(
-                bb_id,
-                inst_id,
-                list(map(int, parts[3:])))
+        if name == 'control':
+            return ControlNode(bb_id, inst_id, list(map(int, args)))
+
+        if name == 'call':
+            return CallNode(bb_id, inst_id, int(args[0]))
 
-        if parts[2] == 'SB_CONFIG':
+        if name == 'SB_CONFIG':
             return ConfigNode(bb_id, inst_id)
 
-        elif parts[2] == 'SB_WAIT':
+        elif name == 'SB_WAIT':
             return WaitNode(bb_id, inst_id)
 
-        elif parts[2] == 'SB_MEM_PORT_STREAM':
+        elif name == 'SB_MEM_PORT_STREAM':
             return PortNode(
                 bb_id,
                 inst_id,
-                int(parts[3]),
-                Analyzer.ComputeSymbolicNumElems(parts[6], parts[4], parts[5]))
+                int(args[0]),
+                Analyzer.ComputeSymbolicNumElems(args[3], args[1], args[2]))
 
-        elif parts[2] == 'SB_CONSTANT':
+        elif name == 'SB_CONSTANT':
             return PortNode(
                 bb_id,
                 inst_id,
-                int(parts[3]),
-                Analyzer.ComputeSymbolicNumElems(parts[4]))
+                int(args[0]),
+                Analyzer.ComputeSymbolicNumElems(args[1]))
 
-        elif parts[2] == 'SB_DISCARD':
+        elif name == 'SB_DISCARD':
             return PortNode(
                 bb_id,
                 inst_id,
-                int(parts[3]),
-                Analyzer.ComputeSymbolicNumElems(parts[4]))
+                int(args[0]),
+                Analyzer.ComputeSymbolicNumElems(args[1]))
 
-        elif parts[2] == 'SB_PORT_MEM_STREAM':
+        elif name == 'SB_PORT_MEM_STREAM':
             return PortNode(
                 bb_id,
                 inst_id,
-                int(parts[3]),
-                Analyzer.ComputeSymbolicNumElems(parts[6], parts[4], parts[5]))
+                int(args[0]),
+                Analyzer.ComputeSymbolicNumElems(args[3], args[1], args[2]))
 
-        assert False, line
+        elif name == 'SB_MEM_SCRATCH_STREAM':
+            return ScratchNode(bb_id, inst_id)
+
+        elif name == 'SB_BARRIER':
+            return BarrierNode(bb_id, inst_id)
+
+        assert False, (bb_id, inst_id, name, args)
 
     @staticmethod
-    def BuildGraph(filename):
-        nodes = []
-        entry_points = {}
-        exit_points = []
-        num_bbs = 0
+    def BuildNode(line):
+        parts = list(filter(
+            lambda p: len(p) > 0,
+            map(lambda p: p.strip(), line.split(','))))
+
+        return Analyzer.MakeNode(
+            int(parts[0]), int(parts[1]), parts[2], parts[3:])
 
-        # Initially just build all the nodes
+    @staticmethod
+    def LoadTextBlocks(filename, function):
+        """ Reads the list of nodes of each block of one function from a CSV
+        distilled graph
+
+        Graphs distilled before the CSV held several functions have no
+        function lines. All of their nodes belong to the requested function.
+        """
+        blocks = {}
+        found = False
+        sections = False
+        current = None
         with open(filename) as f:
             for line in f:
+                if line.startswith('function,'):
+                    sections = True
+                    current = line.rstrip('\n').split(',', 2)[2]
+                    found = found or current == function
+                    continue
+                if sections and current != function:
+                    continue
                 n = Analyzer.BuildNode(line)
-                num_bbs = max(n.bb_id, num_bbs)
-                nodes.append(n)
+                blocks.setdefault(n.bb_id, []).append(n)
+
+        if sections and not found:
+            raise RuntimeError(
+                '{}: function {} was not distilled'.format(filename, function))
+        return [blocks[bb_id] for bb_id in range(len(blocks))]
+
+    @staticmethod
+    def LoadBinaryBlocks(filename, function):
+        """ Reads the list of nodes of each block of one function from a
+        binary distilled graph
+
+        The file is mapped rather than read, and its records are unpacked in
+        place, one block at a time through the block index.
+        """
+        with open(filename, 'rb') as f, \
+                mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+            magic, version, num_functions, num_blocks, num_nodes, num_edges, \
+                strings_size = DISTILLED_HEADER.unpack_from(m, 0)
+            if magic != DISTILLED_MAGIC or version != DISTILLED_VERSION:
+                raise RuntimeError(
+                    '{}: not a version {} distilled graph'.format(
+                        filename, DISTILLED_VERSION))
+
+            functions_offset = DISTILLED_HEADER.size
+            blocks_offset = \
+                functions_offset + num_functions * DISTILLED_FUNCTION.size
+            nodes_offset = blocks_offset + num_blocks * DISTILLED_BLOCK.size
+            edges_offset = nodes_offset + num_nodes * DISTILLED_NODE.size
+            strings_offset = edges_offset + num_edges * 4
+            if strings_offset + strings_size != len(m):
+                raise RuntimeError(
+                    '{}: file size does not match the header'.format(filename))
+
+            edges = struct.unpack_from(
+                '<{}I'.format(num_edges), m, edges_offset)
+            names = {}
+            def Name(offset):
+                if offset not in names:
+                    start = strings_offset + offset
+                    names[offset] = m[start:m.find(b'\0', start)].decode()
+                return names[offset]
+
+            for index in range(num_functions):
+                name, first_block, num_function_blocks, _ = \
+                    DISTILLED_FUNCTION.unpack_from(
+                        m, functions_offset + index * DISTILLED_FUNCTION.size)
+                if Name(name) == function:
+                    break
+            else:
+                raise RuntimeError('{}: function {} was not distilled'.format(
+                    filename, function))
+
+            blocks = []
+            for bb_id in range(num_function_blocks):
+                first_node, num_block_nodes, first_edge, num_block_edges = \
+                    DISTILLED_BLOCK.unpack_from(
+                        m, blocks_offset
+                            + (first_block + bb_id) * DISTILLED_BLOCK.size)
+                bb = []
+                for node in range(first_node, first_node + num_block_nodes):
+                    _, inst_id, name, num_args, *args = \
+                        DISTILLED_NODE.unpack_from(
+                            m, nodes_offset + node * DISTILLED_NODE.size)
+                    name = Name(name)
+                    if name == 'control':
+                        args = edges[first_edge:first_edge + num_block_edges]
+                    else:
+                        args = args[:num_args]
+                    bb.append(Analyzer.MakeNode(bb_id, inst_id, name, args))
+                blocks.append(bb)
+
+        return blocks
+
+    @staticmethod
+    def BuildGraph(filename, function='main'):
+        entry_points = {}
+        exit_points = []
+
+        # Initially just build all the nodes of the function, grouped by basic
+        # block. The distiller writes the binary format by default and CSV
+        # with --format=csv.
+        with open(filename, 'rb') as f:
+            is_binary = f.read(len(DISTILLED_MAGIC)) == DISTILLED_MAGIC
+
+        if is_binary:
+            blocks = Analyzer.LoadBinaryBlocks(filename, function)
+        else:
+            blocks = Analyzer.LoadTextBlocks(filename, function)
 
-        num_bbs += 1
+        nodes = [n for bb in blocks for n in bb]
+        num_bbs = len(blocks)
 
         #
         # Now link the nodes by their control flow
@@ -312,8 +437,7 @@ class Analyzer():
         # First find basic block entry nodes and link instructions inside each
         # block.
         for bb_id in range(num_bbs):
-            bb = list(filter(lambda n: n.bb_id == bb_id, nodes))
-            sorted(bb, key=lambda n: n.inst_id)
+            bb = blocks[bb_id]
 
             entry_points[bb_id] = bb[0]
             exit_points.append(bb[-1])
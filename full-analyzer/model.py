@@ -86,6 +86,30 @@ class WaitNode(DataflowNode):
     def TypeName(self):
         return 'Wait'
 
+class ScratchNode(DataflowNode):
+    def __init__(self, bb_id, inst_id):
+        super().__init__(bb_id, inst_id)
+
+    def TypeName(self):
+        return 'ScratchCmd'
+
+class BarrierNode(DataflowNode):
+    def __init__(self, bb_id, inst_id):
+        super().__init__(bb_id, inst_id)
+
+    def TypeName(self):
+        return 'Barrier'
+
+# Calls of other distilled functions are not descended into; the analyzer
+# works on one function at a time.
+class CallNode(DataflowNode):
+    def __init__(self, bb_id, inst_id, callee):
+        super().__init__(bb_id, inst_id)
+        self.callee = callee
+
+    def TypeName(self):
+        return 'Call'
+
 class ControlNode(DataflowNode):
     def __init__(self, bb_id, inst_id, target_bbs):
         super().__init__(bb_id, inst_id)
@@ -0,0 +1,319 @@
+// Microbenchmarks for the dataflow framework and the port assignment domain.
+// Built as balance-analyzer-benchmarks with -DBUILD_BENCHMARKS=ON; see the
+// README for how to run them.
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include "assignment_transfer.h"
+#include "dfa.h"
+#include "port_assignment.h"
+#include "stream_intrinsics.h"
+
+namespace {
+
+// The analysis of the balance analyzer's set domain, with the merge steps of
+// the solver made accessible.
+template <unsigned NumPorts>
+class SetAnalysis
+    : public analysis::DataflowAnalysis<AssignmentSet<NumPorts>,
+                                        AssignmentSetExtend<AssignmentSet<NumPorts>>,
+                                        AssignmentSetCombine<NumPorts>,
+                                        analysis::Forward,
+                                        AssignmentSetWiden<NumPorts>> {
+public:
+    using Base = analysis::DataflowAnalysis<AssignmentSet<NumPorts>,
+                                            AssignmentSetExtend<AssignmentSet<NumPorts>>,
+                                            AssignmentSetCombine<NumPorts>,
+                                            analysis::Forward,
+                                            AssignmentSetWiden<NumPorts>>;
+    using Base::Base;
+    using Base::mergeStateFromPredecessors;
+};
+
+// Builds a module with the stubs of the SB_* intrinsics that main() uses.
+struct Kernel {
+    llvm::LLVMContext context;
+    std::unique_ptr<llvm::Module> module;
+    llvm::Function* config;
+    llvm::Function* constant;
+    llvm::Function* wait;
+    llvm::GlobalVariable* flag;
+
+    Kernel()
+        : module{std::make_unique<llvm::Module>("kernel", context)} {
+        auto* voidTy = llvm::Type::getVoidTy(context);
+        config = makeStub("SB_CONFIG", llvm::FunctionType::get(voidTy, false));
+        wait = makeStub("SB_WAIT", llvm::FunctionType::get(voidTy, false));
+        constant = makeStub("SB_CONSTANT", llvm::FunctionType::get(voidTy,
+            {llvm::Type::getInt32Ty(context), llvm::Type::getInt64Ty(context),
+             llvm::Type::getInt16Ty(context)}, false));
+
+        auto* i32 = llvm::Type::getInt32Ty(context);
+        flag = new llvm::GlobalVariable(*module, i32, false,
+            llvm::GlobalValue::ExternalLinkage,
+            llvm::ConstantInt::get(i32, 0), "flag");
+    }
+
+    llvm::Function*
+    makeStub(const char* name, llvm::FunctionType* type) {
+        auto* stub = llvm::Function::Create(type,
+            llvm::GlobalValue::ExternalLinkage, name, *module);
+        llvm::IRBuilder<> builder{llvm::BasicBlock::Create(context, "", stub)};
+        builder.CreateRetVoid();
+        return stub;
+    }
+
+    void
+    streamConstant(llvm::IRBuilder<>& builder, unsigned port, unsigned nelems) {
+        builder.CreateCall(constant, {builder.getInt32(port),
+                                      builder.getInt64(0),
+                                      builder.getInt16(nelems)});
+    }
+
+    // Unrelated arithmetic, as found between the stream commands of real
+    // kernels.
+    static void
+    addFiller(llvm::IRBuilder<>& builder, llvm::Value* seed, unsigned count) {
+        for (unsigned i = 0; i < count; ++i) {
+            seed = builder.CreateAdd(seed, builder.getInt32(i));
+        }
+    }
+
+    // main() configures the ports and then runs `numDiamonds` branches that
+    // stream into port 1 or port 2, followed by a balanced loop.
+    llvm::Function*
+    buildMain(unsigned numDiamonds) {
+        auto* main = llvm::Function::Create(
+            llvm::FunctionType::get(llvm::Type::getInt32Ty(context), false),
+            llvm::GlobalValue::ExternalLinkage, "main", *module);
+        llvm::IRBuilder<> builder{llvm::BasicBlock::Create(context, "entry", main)};
+        builder.CreateCall(config);
+
+        for (unsigned d = 0; d < numDiamonds; ++d) {
+            auto* then = llvm::BasicBlock::Create(context, "then", main);
+            auto* other = llvm::BasicBlock::Create(context, "else", main);
+            auto* join = llvm::BasicBlock::Create(context, "join", main);
+
+            auto* value = builder.CreateLoad(flag->getValueType(), flag);
+            builder.CreateCondBr(
+                builder.CreateICmpEQ(value, builder.getInt32(d)), then, other);
+
+            builder.SetInsertPoint(then);
+            addFiller(builder, value, 8);
+            streamConstant(builder, 1, 4);
+            builder.CreateBr(join);
+
+            builder.SetInsertPoint(other);
+            addFiller(builder, value, 8);
+            streamConstant(builder, 2, 4);
+            builder.CreateBr(join);
+
+            builder.SetInsertPoint(join);
+        }
+
+        auto* preheader = builder.GetInsertBlock();
+        auto* loop = llvm::BasicBlock::Create(context, "loop", main);
+        auto* exit = llvm::BasicBlock::Create(context, "exit", main);
+        builder.CreateBr(loop);
+        builder.SetInsertPoint(loop);
+        auto* counter = builder.CreatePHI(builder.getInt32Ty(), 2);
+        counter->addIncoming(builder.getInt32(0), preheader);
+        streamConstant(builder, 1, 2);
+        streamConstant(builder, 2, 2);
+        auto* next = builder.CreateAdd(counter, builder.getInt32(1));
+        counter->addIncoming(next, loop);
+        builder.CreateCondBr(
+            builder.CreateICmpULT(next, builder.getInt32(16)), loop, exit);
+
+        builder.SetInsertPoint(exit);
+        builder.CreateCall(wait);
+        builder.CreateRet(builder.getInt32(0));
+        return main;
+    }
+
+    // A function whose block `join` has `numPredecessors` predecessors.
+    llvm::Function*
+    buildJoin(unsigned numPredecessors) {
+        auto* f = llvm::Function::Create(
+            llvm::FunctionType::get(llvm::Type::getVoidTy(context), false),
+            llvm::GlobalValue::ExternalLinkage, "join", *module);
+        auto* entry = llvm::BasicBlock::Create(context, "entry", f);
+        auto* join = llvm::BasicBlock::Create(context, "join", f);
+
+        llvm::IRBuilder<> builder{entry};
+        auto* value = builder.CreateLoad(flag->getValueType(), flag);
+        auto* dispatch = builder.CreateSwitch(value, join, numPredecessors);
+        for (unsigned p = 1; p < numPredecessors; ++p) {
+            auto* arm = llvm::BasicBlock::Create(context, "arm", f, join);
+            dispatch->addCase(builder.getInt32(p), arm);
+            llvm::IRBuilder<>{arm}.CreateBr(join);
+        }
+        llvm::IRBuilder<>{join}.CreateRetVoid();
+        return f;
+    }
+};
+
+
+template <unsigned NumPorts>
+std::array<int, NumPorts>
+makePortValues(int seed) {
+    std::array<int, NumPorts> values;
+    for (unsigned i = 0; i < NumPorts; ++i) {
+        values[i] = (seed * 7 + i * 13) % 64 + 8;
+    }
+    return values;
+}
+
+// Sorted ids of `size` distinct assignments, starting at the `first`-th.
+template <unsigned NumPorts>
+AssignmentSet<NumPorts>
+makeSet(unsigned first, unsigned size) {
+    auto& table = PortAssignmentTable<NumPorts>::Global();
+    std::vector<AssignmentId> ids;
+    for (unsigned i = first; i < first + size; ++i) {
+        std::array<int, NumPorts> values{};
+        values[0] = i;
+        ids.push_back(table.Intern(PortAssignment<NumPorts>{values}));
+    }
+    std::sort(ids.begin(), ids.end());
+    return AssignmentSet<NumPorts>{std::move(ids)};
+}
+
+
+template <unsigned NumPorts>
+void
+BM_PortAssignmentNormalize(benchmark::State& state) {
+    auto values = makePortValues<NumPorts>(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(values);
+        PortAssignment<NumPorts> assignment{values};
+        benchmark::DoNotOptimize(assignment);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_PortAssignmentNormalize, 2)->Arg(1);
+BENCHMARK_TEMPLATE(BM_PortAssignmentNormalize, 4)->Arg(1);
+BENCHMARK_TEMPLATE(BM_PortAssignmentNormalize, 8)->Arg(1);
+BENCHMARK_TEMPLATE(BM_PortAssignmentNormalize, 16)->Arg(1);
+
+
+template <unsigned NumPorts>
+void
+BM_AssignmentSetUnion(benchmark::State& state) {
+    unsigned size = state.range(0);
+    auto s1 = makeSet<NumPorts>(0, size);
+    auto s2 = makeSet<NumPorts>(size / 2, size);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(s1 + s2);
+    }
+    state.SetItemsProcessed(state.iterations() * 2 * size);
+}
+BENCHMARK_TEMPLATE(BM_AssignmentSetUnion, 2)->RangeMultiplier(4)->Range(1, 1024);
+BENCHMARK_TEMPLATE(BM_AssignmentSetUnion, 16)->RangeMultiplier(4)->Range(1, 1024);
+
+
+// Includes the copy of the set, as a transfer copies the state it updates.
+template <unsigned NumPorts>
+void
+BM_AssignmentSetAddAtPort(benchmark::State& state) {
+    unsigned size = state.range(0);
+    auto set = makeSet<NumPorts>(0, size);
+    for (auto _ : state) {
+        auto updated = set;
+        updated.AddAtPort(NumPorts - 1, 4);
+        benchmark::DoNotOptimize(updated);
+    }
+    state.SetItemsProcessed(state.iterations() * size);
+}
+BENCHMARK_TEMPLATE(BM_AssignmentSetAddAtPort, 2)->RangeMultiplier(4)->Range(1, 1024);
+BENCHMARK_TEMPLATE(BM_AssignmentSetAddAtPort, 4)->RangeMultiplier(4)->Range(1, 1024);
+BENCHMARK_TEMPLATE(BM_AssignmentSetAddAtPort, 16)->RangeMultiplier(4)->Range(1, 1024);
+
+
+// Every element is added twice, as blocks are re-queued while still pending.
+void
+BM_WorkListThroughput(benchmark::State& state) {
+    unsigned size = state.range(0);
+    for (auto _ : state) {
+        analysis::WorkList<unsigned> work;
+        for (unsigned i = 0; i < size; ++i) {
+            work.add(i);
+            work.add(i / 2);
+        }
+        while (!work.empty()) {
+            benchmark::DoNotOptimize(work.take());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_WorkListThroughput)->RangeMultiplier(8)->Range(8, 1 << 15);
+
+
+// Merges the exit states of all predecessors of a join block. Every state
+// holds the port counts as its single fact.
+void
+BM_MergeStateFromPredecessors(benchmark::State& state) {
+    constexpr unsigned NumPorts = 4;
+    unsigned numPredecessors = state.range(0);
+
+    Kernel kernel;
+    auto* f = kernel.buildJoin(numPredecessors);
+    softbrain::StreamIntrinsics sb{*kernel.module};
+    SetAnalysis<NumPorts> analysis{*kernel.module, {f},
+        AssignmentSetExtend<AssignmentSet<NumPorts>>{sb, nullptr}};
+
+    analysis::FunctionNumbering numbering{*f};
+    analysis::DataflowResult<AssignmentSet<NumPorts>> results{numbering};
+    unsigned join = numbering.getBlockId(&f->back());
+    for (unsigned p : numbering.getPredecessors(join)) {
+        auto& exitState =
+            results.at(analysis::Forward::getExitSlot(numbering, p));
+        exitState[nullptr] = makeSet<NumPorts>(p, 8);
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            analysis.mergeStateFromPredecessors(join, results, false));
+    }
+    state.SetItemsProcessed(state.iterations() * numPredecessors);
+}
+BENCHMARK(BM_MergeStateFromPredecessors)->Arg(2)->Arg(8)->Arg(32);
+
+
+// Solves a whole kernel, including building the sparse graph and the
+// iteration order of main().
+template <unsigned NumPorts>
+void
+BM_ComputeDataflow(benchmark::State& state) {
+    Kernel kernel;
+    auto* main = kernel.buildMain(state.range(0));
+    softbrain::StreamIntrinsics sb{*kernel.module};
+
+    for (auto _ : state) {
+        SetAnalysis<NumPorts> analysis{*kernel.module, {main},
+            AssignmentSetExtend<AssignmentSet<NumPorts>>{sb, nullptr},
+            AssignmentSetWiden<NumPorts>{}};
+        analysis.computeDataflow();
+        benchmark::DoNotOptimize(analysis);
+    }
+    state.SetItemsProcessed(state.iterations() * main->size());
+}
+BENCHMARK_TEMPLATE(BM_ComputeDataflow, 2)->RangeMultiplier(4)->Range(1, 256);
+BENCHMARK_TEMPLATE(BM_ComputeDataflow, 8)->RangeMultiplier(4)->Range(1, 256);
+
+} // end namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,85 @@
+#ifndef CONTEXT_TABLE_H
+#define CONTEXT_TABLE_H
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Instruction.h"
+
+
+namespace analysis {
+
+
+using ContextId = unsigned;
+
+
+// A ContextTable interns the call strings used as calling contexts by the
+// interprocedural analysis. A call string is the sequence of the (at most)
+// `depth` most recent call sites, and every distinct call string is referred
+// to by a small integer id. Contexts therefore hash and compare as integers,
+// and extending a context by a call site is a single memoized lookup.
+//
+// A depth of 0 yields a context insensitive analysis. The table is not
+// thread safe; a parallel DataflowAnalysis only uses it under its lock.
+class ContextTable {
+public:
+  // The context of the entry points, i.e. the empty call string.
+  static constexpr ContextId kRoot = 0;
+
+  explicit ContextTable(unsigned depth = 2)
+    : depth{depth} {
+    intern({});
+  }
+
+  unsigned getDepth() const { return depth; }
+  std::size_t size() const { return callStrings.size(); }
+
+  // The call sites of a context, oldest first.
+  llvm::ArrayRef<llvm::Instruction*>
+  getCallString(ContextId context) const {
+    return callStrings[context];
+  }
+
+  // The context of a function called from `callSite` within `context`.
+  ContextId
+  extend(ContextId context, llvm::Instruction* callSite) {
+    auto [found, inserted] = extensions.insert({{context, callSite}, kRoot});
+    if (!inserted || depth == 0) {
+      return found->second;
+    }
+
+    std::vector<llvm::Instruction*> callString = callStrings[context];
+    callString.push_back(callSite);
+    if (callString.size() > depth) {
+      callString.erase(callString.begin());
+    }
+
+    found->second = intern(std::move(callString));
+    return found->second;
+  }
+
+private:
+  unsigned depth;
+  std::vector<std::vector<llvm::Instruction*>> callStrings;
+  std::map<std::vector<llvm::Instruction*>, ContextId> ids;
+  llvm::DenseMap<std::pair<ContextId, llvm::Instruction*>, ContextId>
+    extensions;
+
+  ContextId
+  intern(std::vector<llvm::Instruction*> callString) {
+    auto [found, inserted] = ids.insert({callString, callStrings.size()});
+    if (inserted) {
+      callStrings.push_back(std::move(callString));
+    }
+    return found->second;
+  }
+};
+
+
+} // end namespace
+
+
+#endif
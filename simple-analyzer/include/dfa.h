@@ -3,50 +3,36 @@
 #define DATAFLOW_ANALYSIS_H
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
+#include "llvm/ADT/BitVector.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
 
-
-namespace llvm {
-
-
-template<unsigned long Size>
-struct DenseMapInfo<std::array<llvm::Instruction*, Size>> {
-  using Context = std::array<llvm::Instruction*, Size>;
-  static inline Context
-  getEmptyKey() {
-    Context c;
-    std::fill(c.begin(), c.end(),
-      llvm::DenseMapInfo<llvm::Instruction*>::getEmptyKey());
-    return c;
-  }
-  static inline Context
-  getTombstoneKey() {
-    Context c;
-    std::fill(c.begin(), c.end(),
-      llvm::DenseMapInfo<llvm::Instruction*>::getTombstoneKey());
-    return c;
-  }
-  static unsigned
-  getHashValue(const Context& c) {
-    return llvm::hash_combine_range(c.begin(), c.end());
-  }
-  static bool
-  isEqual(const Context& lhs, const Context& rhs) {
-    return lhs == rhs;
-  }
-};
-
-
-}
+#include "context_table.h"
+#include "function_numbering.h"
+#include "persistent_state.h"
+#include "result_cache.h"
+#include "trace.h"
+#include "work_stealing_pool.h"
 
 
 namespace analysis {
@@ -73,7 +59,7 @@ public:
 
   void
   add(T elt) {
-    if (!inList.count(elt)) {
+    if (inList.insert(elt).second) {
       work.push_back(elt);
     }
   }
@@ -105,39 +91,232 @@ using BasicBlockWorklist = WorkList<llvm::BasicBlock*>;
 //
 // Note: In all cases, the AbstractValue should have a no argument constructor
 // that builds constructs the initial value within the abstract domain.
+//
+// AbstractStates are PersistentStates, so storing the state after every
+// instruction into a DataflowResult shares the underlying map until the next
+// modification rather than copying it.
+//
+// Domains whose analyses only ever track one fact per program point, keyed by
+// nullptr, declare `static constexpr bool kSingleFact = true`. Their states
+// are SingleFactStates instead, and the solver skips everything that only
+// matters for facts about individual Values: phis, arguments and the return
+// values of calls. The one fact is not local to any function, so it flows
+// into and out of calls.
 
-template <typename AbstractValue>
-using AbstractState = llvm::DenseMap<llvm::Value*,AbstractValue>;
+template <typename AbstractValue, typename = void>
+struct IsSingleFact : std::false_type { };
 
+template <typename AbstractValue>
+struct IsSingleFact<AbstractValue,
+                    std::enable_if_t<AbstractValue::kSingleFact>>
+  : std::true_type { };
 
 template <typename AbstractValue>
-using DataflowResult =
-  llvm::DenseMap<llvm::Value*, AbstractState<AbstractValue>>;
+using AbstractState = std::conditional_t<IsSingleFact<AbstractValue>::value,
+                                         SingleFactState<AbstractValue>,
+                                         PersistentState<AbstractValue>>;
 
 
-template <typename AbstractValue>
-bool
-operator==(const AbstractState<AbstractValue>& s1,
-           const AbstractState<AbstractValue>& s2) {
-  if (s1.size() != s2.size()) {
-    return false;
+// Calls `visit(value, abstractValue)` for every fact of a state.
+template <typename AbstractValue, typename Visitor>
+void
+forEachFact(const PersistentState<AbstractValue>& state, Visitor visit) {
+  for (auto& [value, abstract] : state) {
+    visit(value, abstract);
+  }
+}
+
+template <typename AbstractValue, typename Visitor>
+void
+forEachFact(const SingleFactState<AbstractValue>& state, Visitor visit) {
+  if (!state.empty()) {
+    visit(static_cast<llvm::Value*>(nullptr), state.get());
   }
-  return std::all_of(s1.begin(), s1.end(),
-    [&s2] (auto &kvPair) {
-      auto found = s2.find(kvPair.first);
-      return found != s2.end() && found->second == kvPair.second;
-    });
 }
 
 
+// A DataflowResult stores one state per slot of a FunctionNumbering in a flat
+// array, with a bit vector recording which slots hold a state. The solver
+// addresses states by slot. Clients can still use the map-like interface
+// keyed by Values, and iteration visits the present (Value, state) pairs in
+// slot order. A DataflowResult refers to the numbering of its function and
+// must not outlive the analysis that owns the numbering.
+//
+// Results also know the context they were computed in and which of their
+// slots they retain; the states of the other slots are never stored (see
+// RetentionPolicy).
+template <typename AbstractValue>
+class DataflowResult {
+public:
+  using State      = AbstractState<AbstractValue>;
+  using value_type = std::pair<llvm::Value*, State>;
+
+  template <typename Entry>
+  class Iterator {
+  public:
+    Iterator(Entry* entry, const llvm::BitVector* present, unsigned slot)
+      : entry{entry}, present{present}, slot{slot} { }
+
+    Entry& operator*() const { return entry[slot]; }
+    Entry* operator->() const { return &entry[slot]; }
+    bool operator==(const Iterator& other) const { return slot == other.slot; }
+    bool operator!=(const Iterator& other) const { return slot != other.slot; }
+
+    Iterator&
+    operator++() {
+      int next = present->find_next(slot);
+      slot = next < 0 ? present->size() : next;
+      return *this;
+    }
+
+  private:
+    Entry* entry;
+    const llvm::BitVector* present;
+    unsigned slot;
+  };
+
+  using iterator       = Iterator<value_type>;
+  using const_iterator = Iterator<const value_type>;
+
+  DataflowResult() = default;
+
+  explicit DataflowResult(const FunctionNumbering& numbering,
+                          ContextId context = ContextTable::kRoot,
+                          const llvm::BitVector* retained = nullptr)
+    : numbering{&numbering},
+      context{context},
+      retained{retained},
+      present(numbering.size()) {
+    entries.reserve(numbering.size());
+    for (unsigned slot = 0; slot < numbering.size(); ++slot) {
+      entries.push_back({numbering.getValue(slot), State{}});
+    }
+  }
+
+  // Results are created empty by the containers that hold them and are bound
+  // to their function's numbering before the first use.
+  bool isInitialized() const { return numbering != nullptr; }
+  const FunctionNumbering& getNumbering() const { return *numbering; }
+  ContextId getContext() const { return context; }
+
+  // Results without states that are laid out like these ones.
+  DataflowResult
+  cleared() const {
+    return DataflowResult{*numbering, context, retained};
+  }
+
+  bool retains(unsigned slot) const { return !retained || retained->test(slot); }
+
+  bool empty() const { return present.none(); }
+  unsigned size() const { return present.count(); }
+
+  bool has(unsigned slot) const { return present.test(slot); }
+
+  // The state of a slot, which becomes present if it was not yet.
+  State&
+  at(unsigned slot) {
+    present.set(slot);
+    return entries[slot].second;
+  }
+
+  // The state of a slot, or nullptr if it is not present.
+  const State*
+  lookup(unsigned slot) const {
+    return has(slot) ? &entries[slot].second : nullptr;
+  }
+
+  iterator begin() { return {entries.data(), &present, firstSlot()}; }
+  iterator end() { return {entries.data(), &present, present.size()}; }
+  const_iterator begin() const { return {entries.data(), &present, firstSlot()}; }
+  const_iterator end() const { return {entries.data(), &present, present.size()}; }
+
+  iterator
+  find(const llvm::Value* v) {
+    unsigned slot = numbering->lookup(v);
+    return contains(slot) ? iterator{entries.data(), &present, slot} : end();
+  }
+
+  const_iterator
+  find(const llvm::Value* v) const {
+    unsigned slot = numbering->lookup(v);
+    return contains(slot) ? const_iterator{entries.data(), &present, slot} : end();
+  }
+
+  unsigned count(const llvm::Value* v) const { return contains(numbering->lookup(v)); }
+
+  value_type&
+  FindAndConstruct(const llvm::Value* v) {
+    unsigned slot = getSlot(v);
+    present.set(slot);
+    return entries[slot];
+  }
+
+  State& operator[](const llvm::Value* v) { return FindAndConstruct(v).second; }
+
+  bool
+  operator==(const DataflowResult& other) const {
+    if (present != other.present) {
+      return false;
+    }
+    for (auto slot : present.set_bits()) {
+      if (!(entries[slot].second == other.entries[slot].second)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  const FunctionNumbering* numbering = nullptr;
+  ContextId context = ContextTable::kRoot;
+  const llvm::BitVector* retained = nullptr;
+  std::vector<value_type> entries;
+  llvm::BitVector present;
+
+  bool
+  contains(unsigned slot) const {
+    return slot != FunctionNumbering::kNone && has(slot);
+  }
+
+  unsigned
+  getSlot(const llvm::Value* v) const {
+    unsigned slot = numbering->lookup(v);
+    assert(slot != FunctionNumbering::kNone
+           && "value does not belong to the function of this result");
+    return slot;
+  }
+
+  unsigned
+  firstSlot() const {
+    int first = present.find_first();
+    return first < 0 ? present.size() : first;
+  }
+};
+
+
+// The state before `i`, i.e. the state after the closest preceding event or
+// at the start of i's graph block. Only instructions that do not change the
+// state lie in between, so it holds at `i` as well.
 template <typename AbstractValue>
 AbstractState<AbstractValue>&
 getIncomingState(DataflowResult<AbstractValue>& result, llvm::Instruction& i) {
+  auto& numbering = result.getNumbering();
   auto* bb = i.getParent();
-  auto* key = (&bb->front() == &i)
-    ? static_cast<llvm::Value*>(bb)
-    : static_cast<llvm::Value*>(&*--llvm::BasicBlock::iterator{i});
-  return result[key];
+  auto it = llvm::BasicBlock::iterator{i};
+  while (true) {
+    if (it == bb->begin()) {
+      if (numbering.lookup(bb) != FunctionNumbering::kNone) {
+        return result[bb];
+      }
+      // Blocks in the middle of a chain continue their unique predecessor.
+      bb = bb->getUniquePredecessor();
+      it = bb->end();
+    }
+    --it;
+    if (numbering.lookup(&*it) != FunctionNumbering::kNone) {
+      return result[&*it];
+    }
+  }
 }
 
 
@@ -145,6 +324,16 @@ getIncomingState(DataflowResult<AbstractValue>& result, llvm::Instruction& i) {
 // to document the structure of a Transfer policy object as used by the
 // DataflowAnalysis class. For a specific analysis, you should implement
 // a class with the same interface.
+//
+// Calls of functions with a body are analyzed interprocedurally unless
+// `handlesCall()` returns true for them. The transfer is then responsible for
+// modeling the call itself, which is how intrinsic-like functions are kept
+// from being descended into.
+//
+// `isEvent()` tells which instructions may change the abstract state. All
+// other instructions are left out of the graph the solver runs on, so they are
+// never visited and have no results of their own. Phi nodes that should be met
+// by the analysis must be reported as events, too.
 template <typename AbstractValue>
 class Transfer {
 public:
@@ -152,6 +341,16 @@ public:
   operator()(llvm::Value& v, AbstractState<AbstractValue>& s) {
     llvm_unreachable("unimplemented transfer");
   }
+
+  bool
+  handlesCall(llvm::CallSite cs) const {
+    return false;
+  }
+
+  bool
+  isEvent(llvm::Instruction& i) const {
+    return true;
+  }
 };
 
 
@@ -179,9 +378,10 @@ public:
   void print(llvm::raw_ostream& out, AbstractValue& value) { }
   void printState(llvm::raw_ostream& out, AbstractState<AbstractValue>& state) {
     out << "DUMP ";
-    for (auto& kvPair : state) {
-      this->asSubClass().print(out, kvPair.second);
-    }
+    forEachFact(state, [this, &out] (auto*, auto& abstract) {
+      auto value = abstract;
+      this->asSubClass().print(out, value);
+    });
     out << "\n";
   }
 
@@ -190,6 +390,94 @@ private:
 };
 
 
+// This class can be extended with a widening operator for abstract domains
+// with infinite ascending chains. Widening is applied at loop heads once a
+// head has been visited more than `delay` times, and implementing
+// `widenPair()` in the subclass (which must return an upper bound of both
+// arguments) guarantees that the fixpoint iteration terminates. After the
+// ascending iteration has stabilized, up to `narrowingPasses` descending passes
+// are run in which loop heads apply `narrowPair()` to recover precision lost
+// by widening.
+template <typename AbstractValue, typename SubClass>
+class Widening {
+public:
+  explicit Widening(unsigned delay = 3, unsigned narrowingPasses = 1)
+    : delay{delay},
+      narrowingPasses{narrowingPasses}
+      { }
+
+  bool isEnabled() const { return true; }
+  unsigned getDelay() const { return delay; }
+  unsigned getNarrowingPasses() const { return narrowingPasses; }
+
+  AbstractValue
+  widenPair(const AbstractValue& /*older*/,
+            const AbstractValue& /*newer*/) const {
+    llvm_unreachable("unimplemented widening");
+  }
+
+  AbstractValue
+  narrowPair(const AbstractValue& older,
+             const AbstractValue& /*newer*/) const {
+    return older;
+  }
+
+  // Replaces every value of `newer` that also has an older value by the
+  // widening (or narrowing) of the two.
+  void
+  widen(AbstractState<AbstractValue>& newer,
+        const AbstractState<AbstractValue>& older) {
+    combine(newer, older, [this] (auto& o, auto& n) {
+      return this->asSubClass().widenPair(o, n);
+    });
+  }
+
+  void
+  narrow(AbstractState<AbstractValue>& newer,
+         const AbstractState<AbstractValue>& older) {
+    combine(newer, older, [this] (auto& o, auto& n) {
+      return this->asSubClass().narrowPair(o, n);
+    });
+  }
+
+private:
+  unsigned delay;
+  unsigned narrowingPasses;
+
+  SubClass& asSubClass() { return static_cast<SubClass&>(*this); };
+
+  template <typename Combine>
+  void
+  combine(AbstractState<AbstractValue>& newer,
+          const AbstractState<AbstractValue>& older,
+          Combine combineValues) {
+    if constexpr (IsSingleFact<AbstractValue>::value) {
+      if (!older.empty() && !newer.empty() && !(newer.get() == older.get())) {
+        newer[nullptr] = combineValues(older.get(), newer.get());
+      }
+    } else {
+      for (auto& [value, olderValue] : older) {
+        auto found = newer.find(value);
+        if (found == newer.end() || found->second == olderValue) {
+          continue;
+        }
+        auto combined = combineValues(olderValue, found->second);
+        newer[value] = std::move(combined);
+      }
+    }
+  }
+};
+
+
+// The default widening policy for domains with finite ascending chains.
+template <typename AbstractValue>
+class NoWidening : public Widening<AbstractValue, NoWidening<AbstractValue>> {
+public:
+  NoWidening() { }
+  bool isEnabled() const { return false; }
+};
+
+
 class Forward {
 public:
   static auto getInstructions(llvm::BasicBlock& bb) {
@@ -198,14 +486,27 @@ public:
   static auto getFunctionTraversal(llvm::Function& f) {
     return llvm::ReversePostOrderTraversal<llvm::Function*>(&f);
   }
-  static auto* getEntryKey(llvm::BasicBlock& bb) {
-    return &bb;
-  }
   static auto* getExitKey(llvm::BasicBlock& bb) {
     return bb.getTerminator();
   }
-  static llvm::Value* getFunctionValueKey(llvm::BasicBlock& bb) {
-    if (auto* ret = llvm::dyn_cast<llvm::ReturnInst>(bb.getTerminator())) {
+  // The slot that holds the state on exit from a graph block. A block
+  // without events leaves its entry state unchanged.
+  static unsigned getExitSlot(const FunctionNumbering& n, unsigned block) {
+    return n.getNumEvents(block) ? n.getLastEventSlot(block)
+                                 : n.getBlockSlot(block);
+  }
+  // The slot of the first event visited in a block, and of the one visited
+  // after `slot`.
+  static unsigned getFirstSlot(const FunctionNumbering& n, unsigned block) {
+    return n.getFirstEventSlot(block);
+  }
+  static unsigned getNextSlot(unsigned slot) {
+    return slot + 1;
+  }
+  static llvm::Value* getFunctionValueKey(const FunctionNumbering& n,
+                                          unsigned block) {
+    auto* last = n.getBasicBlocks(block).back();
+    if (auto* ret = llvm::dyn_cast<llvm::ReturnInst>(last->getTerminator())) {
       return ret->getReturnValue();
     }
     return nullptr;
@@ -216,6 +517,22 @@ public:
   static auto getPredecessors(llvm::BasicBlock& bb) {
     return llvm::predecessors(&bb);
   }
+  static auto getSuccessors(const FunctionNumbering& n, unsigned block) {
+    return n.getSuccessors(block);
+  }
+  static auto getPredecessors(const FunctionNumbering& n, unsigned block) {
+    return n.getPredecessors(block);
+  }
+  static unsigned getLoopHead(unsigned /*latch*/, unsigned header) {
+    return header;
+  }
+  static auto getTraversal(const FunctionNumbering& n) {
+    return llvm::reverse(n.getPostOrder());
+  }
+  static bool isFunctionExit(const FunctionNumbering& n, unsigned block) {
+    auto* last = n.getBasicBlocks(block).back();
+    return llvm::isa<llvm::ReturnInst>(last->getTerminator());
+  }
   static bool shouldMeetPHI() { return true; }
   template <class State, class Transfer, class Meet>
   static bool prepareSummaryState(llvm::CallSite cs,
@@ -227,17 +544,20 @@ public:
     unsigned index = 0;
     bool needsUpdate = false;
     for (auto& functionArg : callee->args()) {
-      auto* passedConcrete = cs.getArgument(index);
+      auto* passedConcrete = cs.getArgument(index++);
       auto passedAbstract = state.find(passedConcrete);
       if (passedAbstract == state.end()) {
         transfer(*passedConcrete, state);
         passedAbstract = state.find(passedConcrete);
       }
+      // Arguments the transfer has no facts about stay at bottom.
+      if (passedAbstract == state.end()) {
+        continue;
+      }
       auto& arg     = summaryState[&functionArg];
       auto newState = meet({passedAbstract->second, arg});
       needsUpdate |= !(newState == arg);
       arg = newState;
-      ++index;
     }
     return needsUpdate;
   }
@@ -252,14 +572,23 @@ public:
   static auto getFunctionTraversal(llvm::Function& f) {
     return llvm::post_order<llvm::Function*>(&f);
   }
-  static auto* getEntryKey(llvm::BasicBlock& bb) {
-    return &bb;
-  }
   static auto* getExitKey(llvm::BasicBlock& bb) {
     return &*bb.begin();
   }
-  static llvm::Value* getFunctionValueKey(llvm::BasicBlock& bb) {
-    return (&bb == &bb.getParent()->getEntryBlock()) ? getExitKey(bb) : nullptr;
+  static unsigned getExitSlot(const FunctionNumbering& n, unsigned block) {
+    return n.getNumEvents(block) ? n.getFirstEventSlot(block)
+                                 : n.getBlockSlot(block);
+  }
+  static unsigned getFirstSlot(const FunctionNumbering& n, unsigned block) {
+    return n.getLastEventSlot(block);
+  }
+  static unsigned getNextSlot(unsigned slot) {
+    return slot - 1;
+  }
+  static llvm::Value* getFunctionValueKey(const FunctionNumbering& n,
+                                          unsigned block) {
+    auto* first = n.getBasicBlocks(block).front();
+    return isFunctionExit(n, block) ? getExitKey(*first) : nullptr;
   }
   static auto getSuccessors(llvm::BasicBlock& bb) {
     return llvm::predecessors(&bb);
@@ -267,6 +596,22 @@ public:
   static auto getPredecessors(llvm::BasicBlock& bb) {
     return llvm::successors(&bb);
   }
+  static auto getSuccessors(const FunctionNumbering& n, unsigned block) {
+    return n.getPredecessors(block);
+  }
+  static auto getPredecessors(const FunctionNumbering& n, unsigned block) {
+    return n.getSuccessors(block);
+  }
+  static unsigned getLoopHead(unsigned latch, unsigned /*header*/) {
+    return latch;
+  }
+  static auto getTraversal(const FunctionNumbering& n) {
+    return n.getPostOrder();
+  }
+  static bool isFunctionExit(const FunctionNumbering& n, unsigned block) {
+    auto* first = n.getBasicBlocks(block).front();
+    return first == &first->getParent()->getEntryBlock();
+  }
   static bool shouldMeetPHI() { return false; }
   template <class State, class Transfer, class Meet>
   static bool prepareSummaryState(llvm::CallSite cs,
@@ -294,127 +639,526 @@ public:
 };
 
 
+// An iteration strategy determines the order in which the blocks of a
+// function are visited while solving it, and at which blocks widening is
+// applied. A strategy is constructed once per function and numbers the
+// blocks densely in its order, so that per-block bookkeeping can use plain
+// vectors and bit vectors. `iterate(visit)` calls `visit(block, number)` with
+// the block's id in the FunctionNumbering and its number in the order until
+// the function is stable, where `visit` processes the block and returns a
+// BlockUpdate describing what changed.
+struct BlockUpdate {
+  bool entryChanged;
+  bool exitChanged;
+};
+
+
+// The classic chaotic iteration: all blocks are seeded in topological order
+// and a block whose exit state changes queues its successors in FIFO order.
+// Widening is applied at the targets of back edges.
+template <typename Direction>
+class WorklistIteration {
+public:
+  explicit WorklistIteration(const FunctionNumbering& numbering) {
+    static constexpr unsigned kUnreached = ~0u;
+    std::vector<unsigned> numbers(numbering.getNumBlocks(), kUnreached);
+    for (unsigned block : Direction::getTraversal(numbering)) {
+      numbers[block] = blocks.size();
+      blocks.push_back(block);
+    }
+
+    successors.resize(blocks.size());
+    for (unsigned number = 0; number < blocks.size(); ++number) {
+      for (unsigned s : Direction::getSuccessors(numbering, blocks[number])) {
+        if (numbers[s] != kUnreached) {
+          successors[number].push_back(numbers[s]);
+        }
+      }
+    }
+
+    heads.resize(blocks.size());
+    for (auto [latch, header] : numbering.getBackEdges()) {
+      heads.set(numbers[Direction::getLoopHead(latch, header)]);
+    }
+  }
+
+  unsigned size() const { return blocks.size(); }
+  llvm::ArrayRef<unsigned> getBlocks() const { return blocks; }
+  bool isHead(unsigned number) const { return heads.test(number); }
+
+  template <typename Visitor>
+  void
+  iterate(Visitor visit) const {
+    std::deque<unsigned> work(blocks.size());
+    std::iota(work.begin(), work.end(), 0);
+    llvm::BitVector inList(blocks.size(), true);
+
+    while (!work.empty()) {
+      unsigned number = work.front();
+      work.pop_front();
+      inList.reset(number);
+
+      if (!visit(blocks[number], number).exitChanged) {
+        continue;
+      }
+      for (unsigned s : successors[number]) {
+        if (!inList.test(s)) {
+          inList.set(s);
+          work.push_back(s);
+        }
+      }
+    }
+  }
+
+private:
+  std::vector<unsigned> blocks;
+  std::vector<llvm::SmallVector<unsigned, 2>> successors;
+  llvm::BitVector heads;
+};
+
+
+// Bourdoncle's recursive iteration strategy over a weak topological order
+// (WTO) of the CFG. The WTO nests the strongly connected components of the
+// CFG, each headed by a single block. A component is iterated until the entry
+// state of its head is stable, and since the components of inner loops are
+// nested inside, inner loops are stabilized before their enclosing loops are
+// revisited. Widening is only needed at component heads.
+//
+// The WTO is kept flat: the blocks are numbered in WTO order, a component
+// occupies the contiguous range [head, ends[head]) and a plain block ends
+// right after itself.
+template <typename Direction>
+class WeakTopologicalIteration {
+public:
+  explicit WeakTopologicalIteration(const FunctionNumbering& numbering) {
+    Builder builder{numbering};
+    for (unsigned block : Direction::getTraversal(numbering)) {
+      if (!builder.dfn[block]) {
+        Partition partition;
+        builder.visit(block, partition);
+        flatten(partition);
+      }
+    }
+  }
+
+  unsigned size() const { return order.size(); }
+  llvm::ArrayRef<unsigned> getBlocks() const { return order; }
+  bool isHead(unsigned number) const { return heads.test(number); }
+
+  template <typename Visitor>
+  void
+  iterate(Visitor visit) const {
+    iterateRange(0, order.size(), visit);
+  }
+
+private:
+  std::vector<unsigned> order;
+  std::vector<unsigned> ends;
+  llvm::BitVector heads;
+
+  template <typename Visitor>
+  void
+  iterateRange(unsigned begin, unsigned end, Visitor& visit) const {
+    for (unsigned number = begin; number < end; number = ends[number]) {
+      visit(order[number], number);
+      if (!isHead(number)) {
+        continue;
+      }
+      // The body is revisited until the entry state of the head is stable.
+      do {
+        iterateRange(number + 1, ends[number], visit);
+      } while (visit(order[number], number).entryChanged);
+    }
+  }
+
+  // Components are built as a tree first. Bourdoncle's algorithm prepends to
+  // partitions, so they are built in reverse and flattened back to front.
+  struct Element {
+    unsigned block;
+    bool isComponent;
+    std::vector<Element> body;
+  };
+  using Partition = std::vector<Element>;
+
+  struct Builder {
+    static constexpr unsigned kDone = ~0u;
+
+    const FunctionNumbering& numbering;
+    std::vector<unsigned> dfn;
+    std::vector<unsigned> stack;
+    unsigned counter = 0;
+
+    explicit Builder(const FunctionNumbering& numbering)
+      : numbering{numbering},
+        dfn(numbering.getNumBlocks())
+        { }
+
+    // Returns the smallest depth-first number reachable from `block` through
+    // blocks that are still on the stack.
+    unsigned
+    visit(unsigned block, Partition& partition) {
+      stack.push_back(block);
+      dfn[block] = ++counter;
+      unsigned head = counter;
+      bool loop = false;
+
+      for (unsigned s : Direction::getSuccessors(numbering, block)) {
+        unsigned reached = dfn[s];
+        if (!reached) {
+          reached = visit(s, partition);
+        }
+        if (reached <= head) {
+          head = reached;
+          loop = true;
+        }
+      }
+
+      if (head != dfn[block]) {
+        return head;
+      }
+
+      dfn[block] = kDone;
+      unsigned top = stack.back();
+      stack.pop_back();
+      if (!loop) {
+        partition.push_back({block, false, {}});
+        return head;
+      }
+
+      // The other blocks of the component are forgotten and visited again
+      // while building the component's own WTO.
+      while (top != block) {
+        dfn[top] = 0;
+        top = stack.back();
+        stack.pop_back();
+      }
+      Partition body;
+      for (unsigned s : Direction::getSuccessors(numbering, block)) {
+        if (!dfn[s]) {
+          visit(s, body);
+        }
+      }
+      partition.push_back({block, true, std::move(body)});
+      return head;
+    }
+  };
+
+  void
+  flatten(const Partition& partition) {
+    for (auto& element : llvm::reverse(partition)) {
+      unsigned number = order.size();
+      order.push_back(element.block);
+      ends.push_back(number + 1);
+      heads.push_back(element.isComponent);
+      if (element.isComponent) {
+        flatten(element.body);
+        ends[number] = order.size();
+      }
+    }
+  }
+};
+
+
+// Counts the work done by DataflowAnalyses. Counts are collected per solved
+// item and added with relaxed atomics, so one instance can be shared by all
+// solver threads.
+struct SolverStatistics {
+  // (context, function) items solved, counting every rerun of an item.
+  std::atomic<uint64_t> solves{0};
+
+  // Blocks in the iteration orders of the solved items, and how often they
+  // were visited, so blockVisits / blocks is the mean number of iterations
+  // per block. maxBlockVisits is the most visits of one block in one solve.
+  std::atomic<uint64_t> blocks{0};
+  std::atomic<uint64_t> blockVisits{0};
+  std::atomic<uint64_t> maxBlockVisits{0};
+
+  // Instructions interpreted by the transfer.
+  std::atomic<uint64_t> transferCalls{0};
+
+  // The largest abstract value seen. The solver does not know how to measure
+  // values, so this is maintained by transfers that do.
+  std::atomic<uint64_t> peakValueSize{0};
+
+  void notePeakValueSize(uint64_t size) { raise(peakValueSize, size); }
+
+  static void
+  raise(std::atomic<uint64_t>& maximum, uint64_t value) {
+    uint64_t current = maximum.load(std::memory_order_relaxed);
+    while (current < value
+           && !maximum.compare_exchange_weak(current, value,
+                                             std::memory_order_relaxed)) {
+    }
+  }
+};
+
+
+// Which of the states that the solver computes are kept in the results. The
+// solver itself only needs the summaries and the states at the entry and the
+// exit of every graph block, so these are always kept. The states after the
+// other events can be dropped and recomputed on demand with getState(), which
+// makes the stored states proportional to the blocks and the kept events
+// rather than to all events.
+struct RetentionPolicy {
+  enum Kind {
+    All,             // Keep the state after every event.
+    BlockBoundaries, // Keep only the states the solver needs.
+    Matching,        // Also keep the states after the events that match.
+  };
+  Kind kind = All;
+
+  // The events whose states are kept with Matching.
+  std::function<bool(llvm::Instruction&)> matches;
+};
+
+
+// Options that control how a DataflowAnalysis schedules its work.
+struct SolverOptions {
+  // Number of threads used to solve independent (context, function) work
+  // items concurrently. With a single thread, everything runs on the thread
+  // that calls computeDataflow().
+  unsigned numThreads = 1;
+
+  // Length k of the call strings that distinguish the calling contexts of a
+  // function. 0 analyzes every function once for all of its callers.
+  unsigned contextDepth = 2;
+
+  // Receives the Solver and Blocks level events of the analysis, if set.
+  Tracer* tracer = nullptr;
+
+  // Accumulates the counts of the analysis, if set.
+  SolverStatistics* statistics = nullptr;
+
+  // Reuses the results of earlier runs and stores the new ones, if set and
+  // if the abstract values can be cached.
+  ResultCache* cache = nullptr;
+
+  // The states kept in the results.
+  RetentionPolicy retention;
+};
+
+
 template <typename AbstractValue,
           typename Transfer,
           typename Meet,
           typename Direction=Forward,
-          unsigned long ContextSize=2ul>
+          typename Widening=NoWidening<AbstractValue>,
+          template <typename> class Iteration=WeakTopologicalIteration>
 class DataflowAnalysis {
 public:
   using State   = AbstractState<AbstractValue>;
-  using Context = std::array<llvm::Instruction*, ContextSize>;
+  using Context = ContextId;
 
   using FunctionResults = DataflowResult<AbstractValue>;
   using ContextFunction = std::pair<Context, llvm::Function*>;
   using ContextResults  = llvm::DenseMap<llvm::Function*, FunctionResults>;
   using ContextWorklist = WorkList<ContextFunction>;
+  using AllResults      = llvm::DenseMap<Context, ContextResults>;
+  using BlockOrder      = Iteration<Direction>;
 
-  using ContextMapInfo =
-    llvm::DenseMapInfo<std::array<llvm::Instruction*, ContextSize>>;
-  using AllResults = llvm::DenseMap<Context, ContextResults, ContextMapInfo>;
 
+  DataflowAnalysis(llvm::Module& m,
+                   llvm::ArrayRef<llvm::Function*> entryPoints,
+                   Widening widening = Widening{},
+                   SolverOptions options = SolverOptions{})
+    : DataflowAnalysis{m, entryPoints, Transfer{}, std::move(widening), options}
+      { }
+
+  // Transfer policies that carry per-module state, e.g. the functions they
+  // interpret, are constructed by the client and passed in here.
+  DataflowAnalysis(llvm::Module& m,
+                   llvm::ArrayRef<llvm::Function*> entryPoints,
+                   Transfer transfer,
+                   Widening widening = Widening{},
+                   SolverOptions options = SolverOptions{})
+    : DataflowAnalysis{m, entryPoints, std::move(transfer), Meet{},
+                       std::move(widening), options}
+      { }
 
+  // So are meet policies with parameters, e.g. a bound on the size of the
+  // values they produce.
   DataflowAnalysis(llvm::Module& m,
-                          llvm::ArrayRef<llvm::Function*> entryPoints) {
+                   llvm::ArrayRef<llvm::Function*> entryPoints,
+                   Transfer transfer,
+                   Meet meet,
+                   Widening widening = Widening{},
+                   SolverOptions options = SolverOptions{})
+    : module{m},
+      options{options},
+      contexts{options.contextDepth},
+      meet{std::move(meet)},
+      transfer{std::move(transfer)},
+      widening{std::move(widening)} {
+    // Functions without a body have nothing to solve.
     for (auto* entry : entryPoints) {
-      contextWork.add({Context{}, entry});
+      if (!entry->isDeclaration()) {
+        contextWork.add({ContextTable::kRoot, entry});
+      }
+    }
+    if constexpr (kCacheable) {
+      if (options.cache) {
+        cacheKeys = std::make_unique<CacheKeys>(m);
+      }
     }
   }
 
 
   // computeDataflow collects the dataflow facts for all instructions
   // in the program reachable from the entryPoints passed to the constructor.
-  AllResults
+  // The facts stay in the analysis and are visited with forEachResult().
+  //
+  // With more than one thread, every pending (context, function) item becomes
+  // a task of a work-stealing pool. Items whose results change reschedule
+  // their callers as new tasks, and the pool drains once a global fixpoint
+  // is reached.
+  //
+  // With a ResultCache, an item whose function and entry state were solved
+  // by an earlier run reuses those results, provided that a single pass over
+  // its blocks with the current summaries of its callees reproduces them.
+  // The key of an item therefore only covers its own code, and a change in a
+  // callee only invalidates the callers whose results it actually changes.
+  // The results of all items that were solved are stored at the end.
+  void
   computeDataflow() {
+    if (options.numThreads > 1) {
+      WorkStealingPool workers{options.numThreads};
+      {
+        std::lock_guard<std::mutex> guard{solverLock};
+        pool = &workers;
+        while (!contextWork.empty()) {
+          schedule(contextWork.take());
+        }
+      }
+      workers.wait();
+      pool = nullptr;
+    }
+
     while (!contextWork.empty()) {
       auto [context, function] = contextWork.take();
       computeDataflow(*function, context);
     }
 
-    return allResults;
+    if (cacheKeys) {
+      storeResults();
+    }
   }
 
-  // computeDataflow collects the dataflowfacts for all instructions
-  // within Function f with the associated execution context. Functions whose
-  // results are required for the analysis of f will be transitively analyzed.
-  DataflowResult<AbstractValue>
-  computeDataflow(llvm::Function& f, const Context& context) {
-    active.insert({context, &f});
-
-    // First compute the initial outgoing state of all instructions
-    FunctionResults results = allResults.FindAndConstruct(context).second
-                                        .FindAndConstruct(&f).second;
-    if (results.find(getSummaryKey(f)) == results.end()) {
-      for (auto& i : llvm::instructions(f)) {
-        results.FindAndConstruct(&i);
+  // forEachResult calls `visit(callString, function, functionResults)` for
+  // every analyzed (context, function) pair. The order only depends on the
+  // module: functions are visited in module order and the contexts of a
+  // function are ordered by the positions of their call sites. Output
+  // produced this way is stable no matter how the work was scheduled.
+  template <typename Visitor>
+  void
+  forEachResult(Visitor visit) {
+    llvm::DenseMap<llvm::Function*, std::vector<Context>> contextsOf;
+    for (auto& [context, contextResults] : allResults) {
+      for (auto& [function, functionResults] : contextResults) {
+        contextsOf[function].push_back(context);
       }
     }
 
-    // Add all blocks to the worklist in topological order for efficiency
-    auto traversal = Direction::getFunctionTraversal(f);
-    BasicBlockWorklist work(traversal.begin(), traversal.end());
-
-    while (!work.empty()) {
-      auto* bb = work.take();
-
-      // Save a copy of the outgoing abstract state to check for changes.
-      const auto& oldEntryState = results[Direction::getEntryKey(*bb)];
-      const auto oldExitState   = results[Direction::getExitKey(*bb)];
-
-      // Merge the state coming in from all predecessors including the function
-      // summary (which contains arguments, etc.)
-      auto state = mergeStateFromPredecessors(bb, results);
-      mergeInState(state, results[getSummaryKey(f)]);
+    llvm::DenseMap<llvm::Instruction*, unsigned> positions;
+    auto positionOf = [&positions, this] (llvm::Instruction* i) -> unsigned {
+      if (positions.empty()) {
+        for (auto& f : module) {
+          for (auto& inst : llvm::instructions(f)) {
+            positions[&inst] = positions.size() + 1;
+          }
+        }
+      }
+      return positions.lookup(i);
+    };
 
-      // If we have already processed the block and no changes have been made to
-      // the abstract input, we can skip processing the block. Otherwise, save
-      // the new entry state and proceed processing this block.
-      if (state == oldEntryState && !state.empty()) {
+    for (auto& f : module) {
+      auto found = contextsOf.find(&f);
+      if (found == contextsOf.end()) {
         continue;
       }
-      results[bb] = state;
-
-      // Propagate through all instructions in the block
-      for (auto& i : Direction::getInstructions(*bb)) {
-
-        // if (isAnalyzableCall(cs)) {
-        //   analyzeCall(cs, state, context);
-        // } else {
-          applyTransfer(i, state);
-        // }
-//meet.printState(llvm::outs(),state);
-        results[&i] = state;
+      auto& functionContexts = found->second;
+      if (functionContexts.size() > 1) {
+        std::sort(functionContexts.begin(), functionContexts.end(),
+          [&positionOf, this] (Context c1, Context c2) {
+            auto s1 = contexts.getCallString(c1);
+            auto s2 = contexts.getCallString(c2);
+            return std::lexicographical_compare(s1.begin(), s1.end(),
+                                                s2.begin(), s2.end(),
+              [&positionOf] (auto* i1, auto* i2) {
+                return positionOf(i1) < positionOf(i2);
+              });
+          });
       }
-
-      // If the abstract state for this block did not change, then we are done
-      // with this block. Otherwise, we must update the abstract state and
-      // consider changes to successors.
-      if (state == oldExitState) {
-        continue;
+      for (auto context : functionContexts) {
+        visit(contexts.getCallString(context), f,
+              allResults[context][&f]);
       }
+    }
+  }
 
-      for (auto* s : Direction::getSuccessors(*bb)) {
-        work.add(s);
+  // computeDataflow collects the dataflowfacts for all instructions
+  // within Function f with the associated execution context. Functions whose
+  // results are required for the analysis of f will be transitively analyzed.
+  DataflowResult<AbstractValue>
+  computeDataflow(llvm::Function& f, const Context& context) {
+    TraceSpan span{options.tracer, TraceLevel::Solver, "solve", &f, context};
+    ContextFunction item{context, &f};
+    FunctionResults results;
+    const BlockOrder* order = nullptr;
+    std::string cacheKey;
+    {
+      std::lock_guard<std::mutex> guard{solverLock};
+      scheduled.erase(item);
+
+      // Another worker may be solving the same item right now. Rather than
+      // racing with it, ask it to run once more when it is done.
+      if (active.count(item)) {
+        rerun.insert(item);
+        return getResults(context, f);
       }
-
-      if (auto* key = Direction::getFunctionValueKey(*bb)) {
-        auto* summary = getSummaryKey(f);
-        results[&f][summary] = meet({results[&f][summary], state[key]});
+      active.insert(item);
+
+      // Work on a private copy of the results. Copying is cheap since the
+      // states themselves are shared.
+      results = getResults(context, f);
+      order = &getBlockOrder(f);
+      if (cacheKeys) {
+        cacheKey = getCacheKey(context, f, results);
       }
     }
 
+    bool reused = !cacheKey.empty()
+      && reuseCachedResults(cacheKey, results, *order, context);
+    if (!reused) {
+      solve(f, context, results, *order);
+    }
+
     // The overall results for the given function and context are updated if
     // necessary. Updating the results for this (function,context) means that
     // all callers must be updated as well.
-    auto& oldResults = allResults[context][&f];
+    std::lock_guard<std::mutex> guard{solverLock};
+    auto& oldResults = getResults(context, f);
+
+    // Callers may have extended the summary (e.g. the abstract arguments)
+    // while this item was being solved. Those updates must not be lost.
+    mergeInState(results.at(FunctionNumbering::kSummary),
+                 oldResults.at(FunctionNumbering::kSummary));
+
     if (!(oldResults == results)) {
       oldResults = results;
-      for (auto& caller : callers[{context, &f}]) {
-        contextWork.add(caller);
+      for (auto& caller : callers[item]) {
+        schedule(caller);
       }
     }
+    if (reused) {
+      cachedItems.insert(item);
+    } else {
+      cachedItems.erase(item);
+    }
 
-    active.erase({context, &f});
+    active.erase(item);
+    if (rerun.erase(item)) {
+      schedule(item);
+    }
     return results;
   }
 
@@ -433,78 +1177,746 @@ public:
     return called && !called->isDeclaration();
   }
 
+  // analyzeCall solves the callee in the context extended by the call site.
+  // Its results are memoized per (callee, context) together with the entry
+  // state they were computed for: the arguments and all facts that are not
+  // local to the caller. A call whose entry state adds nothing to that
+  // summary reuses the callee's results without solving it again. Afterwards
+  // the non-local facts of `state` are those on exit from the callee.
   void
-  analyzeCall(llvm::CallSite cs, State &state, const Context& context) {
-    Context newContext;
-    if (newContext.size() > 0) {
-      std::copy(context.begin() + 1, context.end(), newContext.begin());
-      newContext.back() = cs.getInstruction();
-    }
-
+  analyzeCall(llvm::CallSite cs, State &state, Context context) {
     auto* caller  = cs.getInstruction()->getFunction();
     auto* callee  = getCalledFunction(cs);
-    auto toCall   = std::make_pair(newContext, callee);
     auto toUpdate = std::make_pair(context, caller);
 
-    auto& calledState  = allResults[newContext][callee];
-    auto& summaryState = calledState[callee];
-    bool needsUpdate   = summaryState.size() == 0;
+    Context newContext;
+    bool shouldCompute = false;
+    {
+      std::lock_guard<std::mutex> guard{solverLock};
+      newContext = contexts.extend(context, cs.getInstruction());
+      auto toCall = std::make_pair(newContext, callee);
+
+      auto& calledState  = getResults(newContext, *callee);
+      bool needsUpdate   = !calledState.has(FunctionNumbering::kSummary);
+      auto& summaryState = calledState.at(FunctionNumbering::kSummary);
+      const auto oldSummaryState = summaryState;
+
+      if constexpr (!kSingleFact) {
+        needsUpdate |= Direction::prepareSummaryState(cs, callee, state, summaryState, transfer, meet);
+      }
+      needsUpdate |= passNonLocalFacts(state, *caller, summaryState);
+
+      // Calls that flow back into the same context, e.g. recursion or
+      // repeated calls when contexts are truncated, form cycles just like
+      // loops do, so summaries are widened after the same delay.
+      if (needsUpdate && widening.isEnabled()
+          && ++summaryUpdates[toCall] > widening.getDelay()) {
+        widening.widen(summaryState, oldSummaryState);
+      }
 
-    needsUpdate |= Direction::prepareSummaryState(cs, callee, state, summaryState, transfer, meet);
+      // A callee that is already being solved (recursively or on another
+      // thread) picks up the new summary when it runs again.
+      shouldCompute = needsUpdate && !active.count(toCall);
+      if (needsUpdate && !shouldCompute) {
+        rerun.insert(toCall);
+      }
+      callers[toCall].insert(toUpdate);
+    }
 
-    if (!active.count(toCall) && needsUpdate) {
+    if (shouldCompute) {
       computeDataflow(*callee, newContext);
     }
 
-    state[cs.getInstruction()] = calledState[callee][callee];
-    callers[toCall].insert(toUpdate);
+    std::lock_guard<std::mutex> guard{solverLock};
+    auto& calleeResults = getResults(newContext, *callee);
+    returnNonLocalFacts(state, *caller, *callee, calleeResults);
+    if constexpr (!kSingleFact) {
+      state[cs.getInstruction()] =
+        calleeResults.at(FunctionNumbering::kSummary)[callee];
+    }
+  }
+
+  // replayCall is analyzeCall for getState(): the callee has been solved for
+  // a summary that already covers `state`, so the facts on exit from it are
+  // only read back from its results. Nothing is solved, widened or recorded.
+  void
+  replayCall(llvm::CallSite cs, State &state, Context context) {
+    auto* caller = cs.getInstruction()->getFunction();
+    auto* callee = getCalledFunction(cs);
+
+    std::lock_guard<std::mutex> guard{solverLock};
+    auto newContext = contexts.extend(context, cs.getInstruction());
+    auto contextResults = allResults.find(newContext);
+    assert(contextResults != allResults.end()
+           && contextResults->second.count(callee)
+           && "replayed calls were analyzed by the solver");
+    auto& calleeResults = contextResults->second.find(callee)->second;
+    auto* committed = calleeResults.lookup(FunctionNumbering::kSummary);
+    assert(committed && "replayed calls were analyzed by the solver");
+
+    // The entry state is met into a copy of the summary, which it must not
+    // change, only to pass the arguments like analyzeCall does.
+    State summaryState = *committed;
+    bool needsUpdate = false;
+    if constexpr (!kSingleFact) {
+      needsUpdate |= Direction::prepareSummaryState(cs, callee, state, summaryState, transfer, meet);
+    }
+    needsUpdate |= passNonLocalFacts(state, *caller, summaryState);
+    assert(!needsUpdate && "the summary of the callee covers replayed calls");
+    (void)needsUpdate;
+
+    returnNonLocalFacts(state, *caller, *callee, calleeResults);
+    if constexpr (!kSingleFact) {
+      state[cs.getInstruction()] = summaryState[callee];
+    }
+  }
+
+  // The state after the event `i` in `results`, or nothing if `i` is no
+  // event or its item was never solved. States that the results do not
+  // retain are recomputed from the entry state of i's graph block, with the
+  // same transfer and callee results as the solver, so they are the states it
+  // would have stored. Calls are only replayed against the results of their
+  // callees, so nothing is solved or widened again. Must be called after
+  // computeDataflow(), e.g. from forEachResult().
+  std::optional<State>
+  getState(FunctionResults& results, llvm::Instruction& i) {
+    auto& numbering = results.getNumbering();
+    unsigned slot = numbering.lookup(&i);
+    if (slot == FunctionNumbering::kNone
+        || slot < numbering.getFirstEventSlot(0)
+        || !results.has(FunctionNumbering::kSummary)) {
+      return std::nullopt;
+    }
+    if (results.retains(slot)) {
+      auto* state = results.lookup(slot);
+      return state ? std::optional<State>{*state} : std::nullopt;
+    }
+
+    // Blocks in the middle of a chain belong to the graph block of the
+    // chain's head. Blocks the solver never reached keep empty states.
+    auto* bb = i.getParent();
+    while (numbering.lookup(bb) == FunctionNumbering::kNone) {
+      bb = bb->getUniquePredecessor();
+    }
+    unsigned block = numbering.getBlockId(bb);
+    auto* entry = results.lookup(numbering.getBlockSlot(block));
+    if (!entry) {
+      return State{};
+    }
+    State state = *entry;
+    for (unsigned event = Direction::getFirstSlot(numbering, block); ;
+         event = Direction::getNextSlot(event)) {
+      applyTransfer(*llvm::cast<llvm::Instruction>(numbering.getValue(event)),
+                    state, results.getContext(), /*replay=*/true);
+      if (event == slot) {
+        return state;
+      }
+    }
   }
 
 private:
+  llvm::Module& module;
+  SolverOptions options;
+  ContextTable contexts;
+
   // These property objects determine the behavior of the dataflow analysis.
   // They should by replaced by concrete implementation classes on a per
   // analysis basis.
   Meet meet;
   Transfer transfer;
+  Widening widening;
 
   AllResults allResults;
   ContextWorklist contextWork;
   llvm::DenseMap<ContextFunction, llvm::DenseSet<ContextFunction>> callers;
   llvm::DenseSet<ContextFunction> active;
+  llvm::DenseMap<ContextFunction, unsigned> summaryUpdates;
+  llvm::DenseMap<llvm::Function*, std::unique_ptr<FunctionNumbering>> numberings;
+  llvm::DenseMap<llvm::Function*, std::unique_ptr<BlockOrder>> blockOrders;
+  llvm::DenseMap<llvm::Function*, std::unique_ptr<llvm::BitVector>> retainedSlots;
+
+  // Guards all of the bookkeeping above when solving in parallel. It is
+  // never held while a function is being solved.
+  std::mutex solverLock;
+  WorkStealingPool* pool = nullptr;
+  llvm::DenseSet<ContextFunction> scheduled;
+  llvm::DenseSet<ContextFunction> rerun;
+
+  // Keys for the ResultCache, and the items whose current results were
+  // reused from it rather than solved.
+  static constexpr bool kCacheable = IsCacheable<AbstractValue>::value;
+  static constexpr bool kSingleFact = IsSingleFact<AbstractValue>::value;
+  std::unique_ptr<CacheKeys> cacheKeys;
+  llvm::DenseSet<ContextFunction> cachedItems;
+
+  // Queues a (context, function) item for (re)analysis. Must be called with
+  // solverLock held.
+  void
+  schedule(const ContextFunction& item) {
+    if (!pool) {
+      contextWork.add(item);
+      return;
+    }
+    if (scheduled.insert(item).second) {
+      pool->async([this, item] {
+        computeDataflow(*item.second, item.first);
+      });
+    }
+  }
+
 
+  // The summary of a function seeds the blocks at which the analysis enters
+  // it: the entry block of a forward and the returning blocks of a backward
+  // analysis. All other blocks receive it through their predecessors.
+  void
+  mergeInSummary(unsigned block, State& state, FunctionResults& results) {
+    if (Direction::getPredecessors(results.getNumbering(), block).empty()) {
+      mergeInState(state, results.at(FunctionNumbering::kSummary));
+    }
+  }
+
+  // Values that belong to a function are its arguments, blocks and
+  // instructions as well as the function itself, which keys its summary.
+  // Facts about all other values, e.g. globals or memory, are not scoped to
+  // the function and flow into and out of its calls.
+  static bool
+  isLocalTo(const llvm::Value* v, const llvm::Function& f) {
+    if (v == &f) {
+      return true;
+    }
+    if (auto* i = llvm::dyn_cast_or_null<llvm::Instruction>(v)) {
+      return i->getFunction() == &f;
+    }
+    if (auto* arg = llvm::dyn_cast_or_null<llvm::Argument>(v)) {
+      return arg->getParent() == &f;
+    }
+    if (auto* bb = llvm::dyn_cast_or_null<llvm::BasicBlock>(v)) {
+      return bb->getParent() == &f;
+    }
+    return false;
+  }
 
-  static llvm::Value*
-  getSummaryKey(llvm::Function& f) {
-    return &f;
+  // Meets the facts of the caller's state that are not local to the caller
+  // into the entry summary of the callee. Returns whether the summary grew.
+  bool
+  passNonLocalFacts(const State& callerState, llvm::Function& caller,
+                    State& summaryState) {
+    if constexpr (kSingleFact) {
+      const State oldSummaryState = summaryState;
+      mergeInState(summaryState, callerState);
+      return !(summaryState == oldSummaryState);
+    } else {
+      bool changed = false;
+      for (auto& [value, abstract] : callerState) {
+        if (isLocalTo(value, caller)) {
+          continue;
+        }
+        auto [found, newlyAdded] = summaryState.insert({value, abstract});
+        if (newlyAdded) {
+          changed = true;
+          continue;
+        }
+        auto met = meet({found->second, abstract});
+        if (!(met == found->second)) {
+          found->second = std::move(met);
+          changed = true;
+        }
+      }
+      return changed;
+    }
   }
 
+  // Replaces the non-local facts of the caller's state by the ones that hold
+  // on exit from the callee, i.e. the meet over all of its exiting blocks.
+  void
+  returnNonLocalFacts(State& callerState, llvm::Function& caller,
+                      llvm::Function& callee, FunctionResults& calleeResults) {
+    if constexpr (kSingleFact) {
+      State exitState;
+      forEachExitState(calleeResults, [this, &exitState] (const State& exitFacts) {
+        mergeInState(exitState, exitFacts);
+      });
+      callerState = exitState;
+    } else {
+      llvm::SmallVector<llvm::Value*, 8> outdated;
+      for (auto& [value, abstract] : callerState) {
+        if (!isLocalTo(value, caller)) {
+          outdated.push_back(value);
+        }
+      }
+      for (auto* value : outdated) {
+        callerState.erase(value);
+      }
+
+      State exitState;
+      forEachExitState(calleeResults,
+        [this, &exitState, &callee] (const State& exitFacts) {
+          for (auto& kvPair : exitFacts) {
+            if (!isLocalTo(kvPair.first, callee)) {
+              auto [found, newlyAdded] = exitState.insert(kvPair);
+              if (!newlyAdded) {
+                found->second = meet({found->second, kvPair.second});
+              }
+            }
+          }
+        });
+      for (auto& kvPair : exitState) {
+        callerState.insert(kvPair);
+      }
+    }
+  }
+
+  // Calls `visit(exitState)` for the state on exit from every block that
+  // leaves the function.
+  template <typename Visitor>
+  static void
+  forEachExitState(const FunctionResults& results, Visitor visit) {
+    auto& numbering = results.getNumbering();
+    for (unsigned block = 0; block < numbering.getNumBlocks(); ++block) {
+      auto* exitFacts = results.lookup(Direction::getExitSlot(numbering, block));
+      if (exitFacts && Direction::isFunctionExit(numbering, block)) {
+        visit(*exitFacts);
+      }
+    }
+  }
+
+protected:
+  // The merge steps are exposed to subclasses, e.g. to benchmark them in
+  // isolation.
   void
   mergeInState(State& destination, const State& toMerge) {
-    for (auto& valueStatePair : toMerge) {
-      // If an incoming Value has an AbstractValue in the already merged
-      // state, meet it with the new one. Otherwise, copy the new value over,
-      // implicitly meeting with bottom.
-      auto [found, newlyAdded] = destination.insert(valueStatePair);
-      if (!newlyAdded) {
-        found->second = meet({found->second, valueStatePair.second});
+    // Merging into an empty state is a plain O(1) snapshot of the other one.
+    if (destination.empty()) {
+      destination = toMerge;
+      return;
+    }
+    if constexpr (kSingleFact) {
+      if (!toMerge.empty() && !(destination == toMerge)) {
+        destination[nullptr] = meet({destination.get(), toMerge.get()});
+      }
+    } else {
+      for (auto& valueStatePair : toMerge) {
+        // If an incoming Value has an AbstractValue in the already merged
+        // state, meet it with the new one. Otherwise, copy the new value over,
+        // implicitly meeting with bottom.
+        auto [found, newlyAdded] = destination.insert(valueStatePair);
+        if (!newlyAdded) {
+          found->second = meet({found->second, valueStatePair.second});
+        }
       }
     }
   }
 
   State
-  mergeStateFromPredecessors(llvm::BasicBlock* bb, FunctionResults& results) {
+  mergeStateFromPredecessors(unsigned block, FunctionResults& results,
+                             bool includeOldEntry = true) {
+    auto& numbering = results.getNumbering();
     State mergedState = State{};
-    mergeInState(mergedState, results[bb]);
-    for (auto* p : Direction::getPredecessors(*bb)) {
-      auto predecessorFacts = results.find(Direction::getExitKey(*p));
-      if (results.end() == predecessorFacts) {
+    if (includeOldEntry) {
+      mergeInState(mergedState, results.at(numbering.getBlockSlot(block)));
+    }
+    for (unsigned p : Direction::getPredecessors(numbering, block)) {
+      auto* predecessorFacts =
+        results.lookup(Direction::getExitSlot(numbering, p));
+      if (!predecessorFacts) {
         continue;
       }
-      mergeInState(mergedState, predecessorFacts->second);
+      mergeInState(mergedState, *predecessorFacts);
     }
     return mergedState;
   }
 
+private:
+  // Stores the new entry state of a block and propagates it through all of
+  // the block's instructions, leaving the exit state in `state`. Only the
+  // states that the results retain are stored.
+  void
+  propagateThroughBlock(unsigned block, State& state,
+                        FunctionResults& results, Context context) {
+    auto& numbering = results.getNumbering();
+    results.at(numbering.getBlockSlot(block)) = state;
+    unsigned slot = Direction::getFirstSlot(numbering, block);
+    for (unsigned count = numbering.getNumEvents(block); count; --count) {
+      auto& event = *llvm::cast<llvm::Instruction>(numbering.getValue(slot));
+      applyTransfer(event, state, context);
+      if (results.retains(slot)) {
+        results.at(slot) = state;
+      }
+      slot = Direction::getNextSlot(slot);
+    }
+  }
+
+
+  // Iterates the blocks of one item to a fixpoint, starting from `results`.
+  void
+  solve(llvm::Function& f, Context context, FunctionResults& results,
+        const BlockOrder& order) {
+    auto& numbering = results.getNumbering();
+
+    // First compute the initial outgoing state of all instructions
+    if (!results.has(FunctionNumbering::kSummary)) {
+      for (unsigned slot = numbering.getFirstEventSlot(0);
+           slot < numbering.size(); ++slot) {
+        if (results.retains(slot)) {
+          results.at(slot);
+        }
+      }
+    }
+
+    llvm::BitVector visited(order.size());
+    std::vector<unsigned> headVisits(order.size());
+    std::vector<unsigned> blockVisits(options.statistics ? order.size() : 0);
+    bool widened = false;
+
+    order.iterate([&] (unsigned block, unsigned number) {
+      TraceSpan blockSpan{options.tracer, TraceLevel::Blocks, "block",
+        numbering.getValue(numbering.getBlockSlot(block)), context};
+      if (options.statistics) {
+        ++blockVisits[number];
+      }
+      // Save a copy of the outgoing abstract state to check for changes.
+      const auto oldEntryState  = results.at(numbering.getBlockSlot(block));
+      const auto oldExitState   =
+        results.at(Direction::getExitSlot(numbering, block));
+
+      // Merge the state coming in from all predecessors including the function
+      // summary (which contains arguments, etc.)
+      auto state = mergeStateFromPredecessors(block, results);
+      mergeInSummary(block, state, results);
+
+      // Once a loop head has been revisited more often than the widening
+      // delay allows, extrapolate its entry state to force convergence.
+      if (widening.isEnabled() && order.isHead(number)
+          && ++headVisits[number] > widening.getDelay()) {
+        widening.widen(state, oldEntryState);
+        widened = true;
+      }
+
+      // If we have already processed the block and no changes have been made to
+      // the abstract input, we can skip processing the block. Otherwise, save
+      // the new entry state and proceed processing this block. Every block is
+      // processed at least once per run, since the summaries of the functions
+      // it calls may have changed since the last one.
+      bool firstVisit = !visited.test(number);
+      visited.set(number);
+      if (!firstVisit && state == oldEntryState) {
+        return BlockUpdate{false, false};
+      }
+      propagateThroughBlock(block, state, results, context);
+
+      // If the abstract state for this block did not change, then we are done
+      // with this block. Otherwise, we must update the abstract state and
+      // consider changes to successors.
+      if (state == oldExitState) {
+        return BlockUpdate{true, false};
+      }
+
+      if constexpr (!kSingleFact) {
+        if (auto* key = Direction::getFunctionValueKey(numbering, block)) {
+          auto& summary = results.at(FunctionNumbering::kSummary);
+          summary[&f] = meet({summary[&f], state[key]});
+        }
+      }
+      return BlockUpdate{true, true};
+    });
+
+    if (widened) {
+      narrowDataflow(results, order, context, blockVisits);
+    }
+    if (auto* statistics = options.statistics) {
+      addCounts(*statistics, blockVisits);
+    }
+  }
+
+  // The cache key of an item: its function, the call string of its context
+  // and its entry state, i.e. its summary without the function's own value.
+  // Returns an empty key if the entry state names values that have no key.
+  // Must be called with solverLock held.
+  std::string
+  getCacheKey(Context context, llvm::Function& f,
+              const FunctionResults& results) {
+    if constexpr (!kCacheable) {
+      return {};
+    } else {
+      std::vector<std::string> entries;
+      bool keyed = true;
+      if (auto* summary = results.lookup(FunctionNumbering::kSummary)) {
+        forEachFact(*summary, [&] (llvm::Value* value, auto& abstract) {
+          if (value == &f) {
+            return;
+          }
+          std::string entry;
+          llvm::raw_string_ostream entryOut{entry};
+          CacheWriter entryWriter{entryOut};
+          keyed &= cacheKeys->writeValue(entryWriter, value);
+          abstract.encode(entryWriter);
+          entries.push_back(std::move(entryOut.str()));
+        });
+      }
+      if (!keyed) {
+        return {};
+      }
+      // States are ordered by pointers, which differ from run to run.
+      std::sort(entries.begin(), entries.end());
+
+      std::string key;
+      llvm::raw_string_ostream out{key};
+      CacheWriter writer{out};
+      writer.write(f.getName());
+      writer.write(cacheKeys->getHash(f));
+      auto callString = contexts.getCallString(context);
+      writer.write(callString.size());
+      for (auto* call : callString) {
+        cacheKeys->writeValue(writer, call);
+      }
+      writer.write(entries.size());
+      for (auto& entry : entries) {
+        out << entry;
+      }
+      return out.str();
+    }
+  }
+
+  // Present slots are written as their slot number and their entries.
+  // Returns an empty string if a state names values that have no key.
+  std::string
+  encodeResults(const FunctionResults& results) {
+    if constexpr (!kCacheable) {
+      return {};
+    } else {
+      std::string data;
+      llvm::raw_string_ostream out{data};
+      CacheWriter writer{out};
+      writer.write(results.size());
+      auto& numbering = results.getNumbering();
+      for (unsigned slot = 0; slot < numbering.size(); ++slot) {
+        auto* state = results.lookup(slot);
+        if (!state) {
+          continue;
+        }
+        writer.write(slot);
+        writer.write(state->size());
+        bool keyed = true;
+        forEachFact(*state, [&] (llvm::Value* value, auto& abstract) {
+          keyed &= cacheKeys->writeValue(writer, value);
+          abstract.encode(writer);
+        });
+        if (!keyed) {
+          return {};
+        }
+      }
+      return out.str();
+    }
+  }
+
+  bool
+  decodeResults(llvm::StringRef data, FunctionResults& results) {
+    if constexpr (!kCacheable) {
+      return false;
+    } else {
+      CacheReader in{data};
+      int64_t numSlots;
+      if (!in.read(numSlots)) {
+        return false;
+      }
+      for (; numSlots > 0; --numSlots) {
+        int64_t slot, size;
+        if (!in.read(slot) || slot < 0
+            || slot >= (int64_t)results.getNumbering().size()
+            || !in.read(size)) {
+          return false;
+        }
+        auto& state = results.at(slot);
+        for (; size > 0; --size) {
+          llvm::Value* value;
+          AbstractValue abstract;
+          if (!cacheKeys->readValue(in, value)
+              || !AbstractValue::decode(in, abstract)) {
+            return false;
+          }
+          if constexpr (kSingleFact) {
+            if (value) {
+              return false;
+            }
+            state[nullptr] = std::move(abstract);
+          } else {
+            state.insert({value, std::move(abstract)});
+          }
+        }
+      }
+      return in.atEnd();
+    }
+  }
+
+  // Replaces `results` by the cached results for `key` if there are any and
+  // they are still a fixpoint: the cached entry state of every block is
+  // propagated through it once, which also solves the callees, and must
+  // reproduce the cached states exactly.
+  bool
+  reuseCachedResults(llvm::StringRef key, FunctionResults& results,
+                     const BlockOrder& order, Context context) {
+    auto& cache = *options.cache;
+    auto data = cache.load(key);
+    FunctionResults cached = results.cleared();
+    if (!data || !decodeResults(*data, cached)) {
+      cache.misses.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    auto& numbering = cached.getNumbering();
+    auto check = cached;
+    for (unsigned block : order.getBlocks()) {
+      auto state = cached.at(numbering.getBlockSlot(block));
+      propagateThroughBlock(block, state, check, context);
+    }
+    if (!(check == cached)) {
+      cache.misses.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    cache.hits.fetch_add(1, std::memory_order_relaxed);
+    results = std::move(cached);
+    return true;
+  }
+
+  // Stores the results of every item that was solved rather than reused.
+  void
+  storeResults() {
+    for (auto& [context, contextResults] : allResults) {
+      for (auto& [function, results] : contextResults) {
+        if (!results.has(FunctionNumbering::kSummary)
+            || cachedItems.count({context, function})) {
+          continue;
+        }
+        auto key  = getCacheKey(context, *function, results);
+        auto data = encodeResults(results);
+        if (!key.empty() && !data.empty()) {
+          options.cache->store(key, data);
+        }
+      }
+    }
+  }
+
+  // Numberings and block orders only depend on the function and are shared
+  // by all of its contexts. Must be called with solverLock held.
+  //
+  // Besides the events of the transfer, calls that are analyzed
+  // interprocedurally change the state and are part of the graph.
+  const FunctionNumbering&
+  getNumbering(llvm::Function& f) {
+    auto& numbering = numberings[&f];
+    if (!numbering) {
+      numbering = std::make_unique<FunctionNumbering>(f,
+        [this] (llvm::Instruction& i) {
+          llvm::CallSite cs{&i};
+          return transfer.isEvent(i)
+            || (isAnalyzableCall(cs) && !transfer.handlesCall(cs));
+        });
+    }
+    return *numbering;
+  }
+
+  const BlockOrder&
+  getBlockOrder(llvm::Function& f) {
+    auto& order = blockOrders[&f];
+    if (!order) {
+      order = std::make_unique<BlockOrder>(getNumbering(f));
+    }
+    return *order;
+  }
+
+  // The results of f in a context, laid out by f's numbering. Must be called
+  // with solverLock held.
+  FunctionResults&
+  getResults(Context context, llvm::Function& f) {
+    auto& results = allResults[context][&f];
+    if (!results.isInitialized()) {
+      results = FunctionResults{getNumbering(f), context, getRetainedSlots(f)};
+    }
+    return results;
+  }
+
+  // The slots of f whose states its results keep, or nullptr for all slots.
+  // Must be called with solverLock held.
+  const llvm::BitVector*
+  getRetainedSlots(llvm::Function& f) {
+    auto& retention = options.retention;
+    if (retention.kind == RetentionPolicy::All) {
+      return nullptr;
+    }
+    auto& retained = retainedSlots[&f];
+    if (!retained) {
+      auto& numbering = getNumbering(f);
+      retained = std::make_unique<llvm::BitVector>(numbering.size());
+      retained->set(FunctionNumbering::kSummary);
+      for (unsigned block = 0; block < numbering.getNumBlocks(); ++block) {
+        retained->set(numbering.getBlockSlot(block));
+        retained->set(Direction::getExitSlot(numbering, block));
+      }
+      if (retention.kind == RetentionPolicy::Matching) {
+        for (unsigned slot = numbering.getFirstEventSlot(0);
+             slot < numbering.size(); ++slot) {
+          auto& event = *llvm::cast<llvm::Instruction>(numbering.getValue(slot));
+          if (retention.matches(event)) {
+            retained->set(slot);
+          }
+        }
+      }
+    }
+    return retained.get();
+  }
+
+  // After widening, the ascending iteration has reached a post-fixpoint that
+  // may be needlessly coarse. Each narrowing pass recomputes all blocks in
+  // order from their predecessors alone (a descending iteration) and lets
+  // loop heads refine their widened entry state.
+  void
+  narrowDataflow(FunctionResults& results, const BlockOrder& order,
+                 Context context, std::vector<unsigned>& blockVisits) {
+    auto& numbering = results.getNumbering();
+    auto blocks = order.getBlocks();
+    for (unsigned pass = 0; pass < widening.getNarrowingPasses(); ++pass) {
+      bool changed = false;
+      for (unsigned number = 0; number < blocks.size(); ++number) {
+        unsigned block = blocks[number];
+        if (options.statistics) {
+          ++blockVisits[number];
+        }
+        const auto oldEntryState = results.at(numbering.getBlockSlot(block));
+        auto state = mergeStateFromPredecessors(block, results, false);
+        mergeInSummary(block, state, results);
+        if (order.isHead(number)) {
+          widening.narrow(state, oldEntryState);
+        }
+        if (state == oldEntryState) {
+          continue;
+        }
+        propagateThroughBlock(block, state, results, context);
+        changed = true;
+      }
+      if (!changed) {
+        break;
+      }
+    }
+  }
+
+  // Adds the counts of one solved item, given the visits of each of its
+  // blocks.
+  static void
+  addCounts(SolverStatistics& statistics,
+            const std::vector<unsigned>& blockVisits) {
+    auto relaxed = std::memory_order_relaxed;
+    statistics.solves.fetch_add(1, relaxed);
+    statistics.blocks.fetch_add(blockVisits.size(), relaxed);
+    statistics.blockVisits.fetch_add(
+      std::accumulate(blockVisits.begin(), blockVisits.end(), uint64_t{0}),
+      relaxed);
+    if (!blockVisits.empty()) {
+      SolverStatistics::raise(statistics.maxBlockVisits,
+        *std::max_element(blockVisits.begin(), blockVisits.end()));
+    }
+  }
+
   AbstractValue
   meetOverPHI(State& state, const llvm::PHINode& phi) {
     auto phiValue = AbstractValue();
@@ -514,18 +1926,38 @@ private:
         transfer(*value.get(), state);
         found = state.find(value.get());
       }
+      if (state.end() == found) {
+        continue;
+      }
       phiValue = meet({phiValue, found->second});
     }
     return phiValue;
   }
 
+  // Applies the event `i` to `state`. Calls of analyzed functions are solved
+  // as needed, or with `replay`, only read back from the callee's results.
   void
-  applyTransfer(llvm::Instruction& i, State& state) {
-    if (auto* phi = llvm::dyn_cast<llvm::PHINode>(&i);
-        phi && Direction::shouldMeetPHI()) {
-      // Phis can be explicit meet operations
-      state[phi] = meetOverPHI(state, *phi);
+  applyTransfer(llvm::Instruction& i, State& state, Context context,
+                bool replay = false) {
+    if constexpr (!kSingleFact) {
+      if (auto* phi = llvm::dyn_cast<llvm::PHINode>(&i);
+          phi && Direction::shouldMeetPHI()) {
+        // Phis can be explicit meet operations
+        state[phi] = meetOverPHI(state, *phi);
+        return;
+      }
+    }
+    if (llvm::CallSite cs{&i};
+        isAnalyzableCall(cs) && !transfer.handlesCall(cs)) {
+      if (replay) {
+        replayCall(cs, state, context);
+      } else {
+        analyzeCall(cs, state, context);
+      }
     } else {
+      if (options.statistics && !replay) {
+        options.statistics->transferCalls.fetch_add(1, std::memory_order_relaxed);
+      }
       transfer(i, state);
     }
   }
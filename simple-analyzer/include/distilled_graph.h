@@ -0,0 +1,468 @@
+#ifndef DISTILLED_GRAPH_H
+#define DISTILLED_GRAPH_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+namespace softbrain {
+
+
+// A distilled graph holds the control flow graphs of the kernel functions of
+// a module, reduced to their stream commands. Every basic block becomes a list
+// of nodes: one per intrinsic call and per call of another distilled function,
+// in program order, followed by a control node that ends the block and
+// carries its successors. The blocks of each function are numbered from 0 in
+// reverse post order, so block 0 is the function's entry.
+//
+// The binary format is a sequence of fixed-width little endian records that
+// can be used in place once the file is mapped into memory:
+//
+//   FileHeader
+//   FunctionRecord[numFunctions]
+//   BlockRecord[numBlocks]      the blocks of each function are contiguous
+//   NodeRecord[numNodes]        the nodes of each block are contiguous
+//   uint32_t[numEdges]          successor block ids, contiguous per block
+//   char[stringTableSize]       NUL terminated function and node names
+//
+// Nodes are named after their intrinsic, "call" or "control". Intrinsics hold
+// the values of their reported arguments (see stream_intrinsics.h), with -1
+// for arguments that are not constant. Calls hold the index of the called
+// function.
+namespace distilled {
+
+inline constexpr char kMagic[8] = {'B', 'A', 'L', 'D', 'I', 'S', 'T', '\0'};
+inline constexpr uint32_t kVersion = 2;
+inline constexpr unsigned kMaxArguments = 4;
+inline constexpr const char* kControl = "control";
+inline constexpr const char* kCall = "call";
+
+using llvm::support::ulittle32_t;
+using llvm::support::little64_t;
+
+struct FileHeader {
+  char magic[8];
+  ulittle32_t version;
+  ulittle32_t numFunctions;
+  ulittle32_t numBlocks;
+  ulittle32_t numNodes;
+  ulittle32_t numEdges;
+  ulittle32_t stringTableSize;
+};
+
+struct FunctionRecord {
+  // Offset of the function's name in the string table.
+  ulittle32_t name;
+  ulittle32_t firstBlock;
+  ulittle32_t numBlocks;
+  ulittle32_t reserved;
+};
+
+struct BlockRecord {
+  ulittle32_t firstNode;
+  ulittle32_t numNodes;
+  ulittle32_t firstEdge;
+  ulittle32_t numEdges;
+};
+
+struct NodeRecord {
+  // The id of the node's block within its function.
+  ulittle32_t block;
+  ulittle32_t inst;
+  // Offset of the node's name in the string table.
+  ulittle32_t name;
+  ulittle32_t numArguments;
+  little64_t arguments[kMaxArguments];
+};
+
+static_assert(sizeof(FileHeader) == 32, "FileHeader must not be padded");
+static_assert(sizeof(FunctionRecord) == 16, "FunctionRecord must not be padded");
+static_assert(sizeof(BlockRecord) == 16, "BlockRecord must not be padded");
+static_assert(sizeof(NodeRecord) == 48, "NodeRecord must not be padded");
+
+} // end namespace distilled
+
+
+// Collects the nodes of a distilled graph and writes them in the binary or
+// in the CSV format. Each function is started with addFunction(), and its
+// blocks are added in the order of their ids, each closed by its control
+// node. Graphs of different functions can be built by separate writers and
+// joined with append().
+class DistilledGraphWriter {
+public:
+  void
+  addFunction(llvm::StringRef name) {
+    distilled::FunctionRecord function;
+    function.name = intern(name);
+    function.firstBlock = blocks.size();
+    function.numBlocks = 0;
+    function.reserved = 0;
+    functions.push_back(function);
+  }
+
+  void
+  addNode(uint32_t block, uint32_t inst, llvm::StringRef name,
+          llvm::ArrayRef<int64_t> arguments) {
+    assert(!functions.empty() && "nodes must belong to a function");
+    assert(block == functions.back().numBlocks
+           && "blocks must be added in id order");
+    assert(arguments.size() <= distilled::kMaxArguments);
+    distilled::NodeRecord node{};
+    node.block = block;
+    node.inst = inst;
+    node.name = intern(name);
+    node.numArguments = arguments.size();
+    for (unsigned i = 0; i < arguments.size(); ++i) {
+      node.arguments[i] = arguments[i];
+    }
+    nodes.push_back(node);
+  }
+
+  void
+  addControl(uint32_t block, uint32_t inst,
+             llvm::ArrayRef<uint32_t> successors) {
+    addNode(block, inst, distilled::kControl, {});
+    distilled::BlockRecord record;
+    record.firstNode = blockStart;
+    record.numNodes = nodes.size() - blockStart;
+    record.firstEdge = edges.size();
+    record.numEdges = successors.size();
+    blocks.push_back(record);
+    edges.insert(edges.end(), successors.begin(), successors.end());
+    functions.back().numBlocks = functions.back().numBlocks + 1;
+    blockStart = nodes.size();
+  }
+
+  // Adds the functions of `other` after the ones added so far.
+  void
+  append(const DistilledGraphWriter& other) {
+    assert(blockStart == nodes.size() && "the last block is not closed");
+    auto nameOf = [&other] (uint32_t offset) {
+      return llvm::StringRef{other.strings.data() + offset};
+    };
+    for (auto function : other.functions) {
+      function.name = intern(nameOf(function.name));
+      function.firstBlock = function.firstBlock + blocks.size();
+      functions.push_back(function);
+    }
+    for (auto block : other.blocks) {
+      block.firstNode = block.firstNode + nodes.size();
+      block.firstEdge = block.firstEdge + edges.size();
+      blocks.push_back(block);
+    }
+    for (auto node : other.nodes) {
+      node.name = intern(nameOf(node.name));
+      nodes.push_back(node);
+    }
+    edges.insert(edges.end(), other.edges.begin(), other.edges.end());
+    blockStart = nodes.size();
+  }
+
+  void
+  writeBinary(llvm::raw_ostream& out) const {
+    distilled::FileHeader header;
+    std::memcpy(header.magic, distilled::kMagic, sizeof(header.magic));
+    header.version = distilled::kVersion;
+    header.numFunctions = functions.size();
+    header.numBlocks = blocks.size();
+    header.numNodes = nodes.size();
+    header.numEdges = edges.size();
+    header.stringTableSize = strings.size();
+
+    writeRecords(out, llvm::makeArrayRef(header));
+    writeRecords(out, llvm::makeArrayRef(functions));
+    writeRecords(out, llvm::makeArrayRef(blocks));
+    writeRecords(out, llvm::makeArrayRef(nodes));
+    std::vector<distilled::ulittle32_t> targets(edges.begin(), edges.end());
+    writeRecords(out, llvm::makeArrayRef(targets));
+    out.write(strings.data(), strings.size());
+  }
+
+  // Every function starts with a line `function,<index>,<name>`, followed by
+  // one line per node: `block,inst,<name>,<arguments...>` for intrinsics and
+  // calls, and `block,inst,control,<successor>,...,` for control nodes.
+  void
+  writeCSV(llvm::raw_ostream& out) const {
+    for (unsigned index = 0; index < functions.size(); ++index) {
+      auto& function = functions[index];
+      out << "function," << index << ',' << (strings.data() + function.name)
+          << '\n';
+      auto functionBlocks = llvm::makeArrayRef(blocks).slice(
+        function.firstBlock, function.numBlocks);
+      for (auto& block : functionBlocks) {
+        for (auto& node : llvm::makeArrayRef(nodes).slice(block.firstNode,
+                                                          block.numNodes)) {
+          llvm::StringRef name{strings.data() + node.name};
+          out << node.block << ',' << node.inst << ',' << name;
+          if (name == distilled::kControl) {
+            out << ',';
+            for (uint32_t successor : llvm::makeArrayRef(edges).slice(
+                   block.firstEdge, block.numEdges)) {
+              out << successor << ',';
+            }
+          }
+          for (unsigned i = 0; i < node.numArguments; ++i) {
+            out << ',' << int64_t(node.arguments[i]);
+          }
+          out << '\n';
+        }
+      }
+    }
+  }
+
+private:
+  std::vector<distilled::FunctionRecord> functions;
+  std::vector<distilled::BlockRecord> blocks;
+  std::vector<distilled::NodeRecord> nodes;
+  std::vector<uint32_t> edges;
+  std::vector<char> strings;
+  llvm::StringMap<uint32_t> stringOffsets;
+  uint32_t blockStart = 0;
+
+  uint32_t
+  intern(llvm::StringRef name) {
+    auto [found, inserted] = stringOffsets.insert({name, strings.size()});
+    if (inserted) {
+      strings.insert(strings.end(), name.begin(), name.end());
+      strings.push_back('\0');
+    }
+    return found->second;
+  }
+
+  template <typename Record>
+  static void
+  writeRecords(llvm::raw_ostream& out, llvm::ArrayRef<Record> records) {
+    out.write(reinterpret_cast<const char*>(records.data()),
+              records.size() * sizeof(Record));
+  }
+};
+
+
+// A read-only view of a binary distilled graph. The file is mapped into
+// memory and its records are used in place, so opening a graph costs one
+// pass to validate it and no copies. The whole file is validated when it is
+// opened, so the accessors do not check their arguments beyond asserts.
+class DistilledGraph {
+public:
+  static llvm::Expected<DistilledGraph>
+  open(const llvm::Twine& path) {
+    auto file = llvm::sys::fs::openNativeFileForRead(path);
+    if (!file) {
+      return file.takeError();
+    }
+    llvm::sys::fs::file_status status;
+    std::error_code ec = llvm::sys::fs::status(*file, status);
+    if (!ec && status.getSize() < sizeof(distilled::FileHeader)) {
+      llvm::sys::fs::closeFile(*file);
+      return makeError(path, "file is too small to be a distilled graph");
+    }
+
+    DistilledGraph graph;
+    if (!ec) {
+      graph.region = std::make_unique<llvm::sys::fs::mapped_file_region>(*file,
+        llvm::sys::fs::mapped_file_region::readonly, status.getSize(), 0, ec);
+    }
+    llvm::sys::fs::closeFile(*file);
+    if (ec) {
+      return llvm::createFileError(path, ec);
+    }
+    if (auto error = graph.validate()) {
+      return makeError(path, error);
+    }
+    return graph;
+  }
+
+  const distilled::FileHeader&
+  getHeader() const {
+    return *reinterpret_cast<const distilled::FileHeader*>(region->const_data());
+  }
+
+  llvm::ArrayRef<distilled::FunctionRecord>
+  getFunctions() const {
+    return {at<distilled::FunctionRecord>(functionsOffset()),
+            getHeader().numFunctions};
+  }
+
+  // The function with the given name, if it was distilled.
+  const distilled::FunctionRecord*
+  findFunction(llvm::StringRef name) const {
+    for (auto& function : getFunctions()) {
+      if (getName(function) == name) {
+        return &function;
+      }
+    }
+    return nullptr;
+  }
+
+  // The blocks of a function, indexed by their ids.
+  llvm::ArrayRef<distilled::BlockRecord>
+  getBlocks(const distilled::FunctionRecord& function) const {
+    return getAllBlocks().slice(function.firstBlock, function.numBlocks);
+  }
+
+  // The nodes of a block. The last one is its control node.
+  llvm::ArrayRef<distilled::NodeRecord>
+  getNodes(const distilled::BlockRecord& block) const {
+    return getAllNodes().slice(block.firstNode, block.numNodes);
+  }
+
+  llvm::ArrayRef<distilled::ulittle32_t>
+  getSuccessors(const distilled::BlockRecord& block) const {
+    return getAllEdges().slice(block.firstEdge, block.numEdges);
+  }
+
+  llvm::StringRef
+  getName(const distilled::FunctionRecord& function) const {
+    return at<char>(stringsOffset() + function.name);
+  }
+
+  llvm::StringRef
+  getName(const distilled::NodeRecord& node) const {
+    return at<char>(stringsOffset() + node.name);
+  }
+
+  bool isControl(const distilled::NodeRecord& node) const {
+    return getName(node) == distilled::kControl;
+  }
+
+  bool isCall(const distilled::NodeRecord& node) const {
+    return getName(node) == distilled::kCall;
+  }
+
+  const distilled::FunctionRecord&
+  getCallee(const distilled::NodeRecord& call) const {
+    assert(isCall(call));
+    return getFunctions()[call.arguments[0]];
+  }
+
+private:
+  // Held by pointer so that graphs can be moved.
+  std::unique_ptr<llvm::sys::fs::mapped_file_region> region;
+
+  DistilledGraph() = default;
+
+  template <typename T>
+  const T*
+  at(uint64_t offset) const {
+    return reinterpret_cast<const T*>(region->const_data() + offset);
+  }
+
+  llvm::ArrayRef<distilled::BlockRecord> getAllBlocks() const {
+    return {at<distilled::BlockRecord>(blocksOffset()), getHeader().numBlocks};
+  }
+  llvm::ArrayRef<distilled::NodeRecord> getAllNodes() const {
+    return {at<distilled::NodeRecord>(nodesOffset()), getHeader().numNodes};
+  }
+  llvm::ArrayRef<distilled::ulittle32_t> getAllEdges() const {
+    return {at<distilled::ulittle32_t>(edgesOffset()), getHeader().numEdges};
+  }
+
+  uint64_t functionsOffset() const { return sizeof(distilled::FileHeader); }
+  uint64_t blocksOffset() const {
+    return functionsOffset()
+      + uint64_t{getHeader().numFunctions} * sizeof(distilled::FunctionRecord);
+  }
+  uint64_t nodesOffset() const {
+    return blocksOffset()
+      + uint64_t{getHeader().numBlocks} * sizeof(distilled::BlockRecord);
+  }
+  uint64_t edgesOffset() const {
+    return nodesOffset()
+      + uint64_t{getHeader().numNodes} * sizeof(distilled::NodeRecord);
+  }
+  uint64_t stringsOffset() const {
+    return edgesOffset() + uint64_t{getHeader().numEdges} * sizeof(uint32_t);
+  }
+
+  // Returns a description of the first inconsistency, or null.
+  const char*
+  validate() const {
+    auto& header = getHeader();
+    if (std::memcmp(header.magic, distilled::kMagic, sizeof(header.magic))) {
+      return "not a distilled graph";
+    }
+    if (header.version != distilled::kVersion) {
+      return "unsupported distilled graph version";
+    }
+    if (stringsOffset() + header.stringTableSize != region->size()) {
+      return "file size does not match the header";
+    }
+    if (header.stringTableSize && at<char>(stringsOffset())
+                                    [header.stringTableSize - 1] != '\0') {
+      return "string table is not terminated";
+    }
+
+    uint64_t blocksSeen = 0;
+    uint64_t nodesSeen = 0;
+    uint64_t edgesSeen = 0;
+    for (auto& function : getFunctions()) {
+      if (function.name >= header.stringTableSize
+          || function.firstBlock != blocksSeen) {
+        return "function index is not contiguous";
+      }
+      blocksSeen += function.numBlocks;
+      if (blocksSeen > header.numBlocks) {
+        return "function index does not match the blocks";
+      }
+
+      auto blocks = getBlocks(function);
+      for (unsigned id = 0; id < blocks.size(); ++id) {
+        auto& block = blocks[id];
+        if (block.firstNode != nodesSeen || block.numNodes == 0
+            || block.firstEdge != edgesSeen) {
+          return "block index is not contiguous";
+        }
+        nodesSeen += block.numNodes;
+        edgesSeen += block.numEdges;
+        if (nodesSeen > header.numNodes || edgesSeen > header.numEdges) {
+          return "block index does not match the nodes and edges";
+        }
+
+        for (uint32_t successor : getSuccessors(block)) {
+          if (successor >= blocks.size()) {
+            return "edge to a block that does not exist";
+          }
+        }
+        for (auto& node : getNodes(block)) {
+          if (node.block != id || node.name >= header.stringTableSize
+              || node.numArguments > distilled::kMaxArguments) {
+            return "malformed node record";
+          }
+          if (isCall(node) && (node.numArguments != 1
+              || uint64_t(node.arguments[0]) >= header.numFunctions)) {
+            return "call of a function that does not exist";
+          }
+        }
+      }
+    }
+    if (blocksSeen != header.numBlocks || nodesSeen != header.numNodes
+        || edgesSeen != header.numEdges) {
+      return "index does not cover all blocks, nodes and edges";
+    }
+    return nullptr;
+  }
+
+  static llvm::Error
+  makeError(const llvm::Twine& path, const char* message) {
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+      "%s: %s", path.str().c_str(), message);
+  }
+};
+
+
+} // end namespace
+
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef FUNCTION_NUMBERING_H
+#define FUNCTION_NUMBERING_H
+
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+
+
+namespace analysis {
+
+
+// A FunctionNumbering is the sparse graph of a function that the solver works
+// on, and it assigns dense indices to everything that dataflow results of the
+// function are keyed on, so that the results can be stored in flat arrays.
+//
+// Only the instructions for which the `isEvent` predicate holds can change the
+// abstract state, and only those are part of the graph. Every chain of basic
+// blocks that is connected by unique successor / unique predecessor edges is
+// collapsed into a single graph block, so the blocks of the graph start at
+// join points and end at split points (or at returns). A graph block is
+// represented by the first basic block of its chain, and its events are the
+// event instructions of the whole chain in order.
+//
+// Slot 0 is the function itself, which keys its summary. It is followed by one
+// slot per graph block and then by one slot per event. Graph blocks are
+// numbered in the layout order of their first basic block, so the entry block
+// always starts block 0, and the events of each block occupy a contiguous range
+// of slots. Blocks also get a block id (their slot minus one), and the edges
+// of the graph are kept as lists of block ids, so that the solver can walk it
+// without looking up any pointers. Looking up the slot of a Value is a hash
+// lookup and is meant for clients, not for the solver's inner loops. Basic
+// blocks in the middle of a chain and instructions that are not events have no
+// slot.
+class FunctionNumbering {
+public:
+  static constexpr unsigned kSummary = 0;
+  static constexpr unsigned kNone    = ~0u;
+
+  template <typename IsEvent>
+  FunctionNumbering(llvm::Function& f, IsEvent isEvent) {
+    values.push_back(&f);
+    collapseChains(f);
+
+    unsigned numBlocks = values.size() - 1;
+    firstEvents.reserve(numBlocks + 1);
+    for (unsigned block = 0; block < numBlocks; ++block) {
+      firstEvents.push_back(values.size());
+      for (auto* bb : getBasicBlocks(block)) {
+        for (auto& i : *bb) {
+          if (isEvent(i)) {
+            slots[&i] = values.size();
+            values.push_back(&i);
+          }
+        }
+      }
+    }
+    firstEvents.push_back(values.size());
+
+    predecessors.resize(numBlocks);
+    successors.resize(numBlocks);
+    for (unsigned block = 0; block < numBlocks; ++block) {
+      for (auto* s : llvm::successors(getBasicBlocks(block).back())) {
+        unsigned successor = getBlockId(s);
+        successors[block].push_back(successor);
+        predecessors[successor].push_back(block);
+      }
+    }
+    computePostOrder();
+  }
+
+  // A numbering in which every instruction is an event.
+  explicit FunctionNumbering(llvm::Function& f)
+    : FunctionNumbering{f, [] (llvm::Instruction&) { return true; }}
+      { }
+
+  unsigned size() const { return values.size(); }
+  unsigned getNumBlocks() const { return predecessors.size(); }
+
+  llvm::Value* getValue(unsigned slot) const { return values[slot]; }
+
+  unsigned
+  lookup(const llvm::Value* v) const {
+    if (v == values[kSummary]) {
+      return kSummary;
+    }
+    auto found = slots.find(v);
+    return found == slots.end() ? kNone : found->second;
+  }
+
+  // The basic blocks collapsed into a graph block, in control flow order.
+  llvm::ArrayRef<llvm::BasicBlock*>
+  getBasicBlocks(unsigned block) const {
+    return llvm::makeArrayRef(chains).slice(firstChainBlocks[block],
+      firstChainBlocks[block + 1] - firstChainBlocks[block]);
+  }
+
+  // The graph block that a basic block has been collapsed into.
+  unsigned getBlockId(const llvm::BasicBlock* bb) const { return blockIds.lookup(bb); }
+  unsigned getBlockSlot(unsigned block) const { return block + 1; }
+
+  unsigned
+  getNumEvents(unsigned block) const {
+    return firstEvents[block + 1] - firstEvents[block];
+  }
+
+  // The slots of the first and last event of a block. For a block without
+  // events, the last slot precedes the first one.
+  unsigned
+  getFirstEventSlot(unsigned block) const {
+    return firstEvents[block];
+  }
+
+  unsigned
+  getLastEventSlot(unsigned block) const {
+    return firstEvents[block + 1] - 1;
+  }
+
+  llvm::ArrayRef<unsigned>
+  getPredecessors(unsigned block) const {
+    return predecessors[block];
+  }
+
+  llvm::ArrayRef<unsigned>
+  getSuccessors(unsigned block) const {
+    return successors[block];
+  }
+
+  // The blocks reachable from the entry block in depth first post order, and
+  // the (latch, header) pairs of the back edges found along the way.
+  llvm::ArrayRef<unsigned> getPostOrder() const { return postOrder; }
+  llvm::ArrayRef<std::pair<unsigned, unsigned>> getBackEdges() const {
+    return backEdges;
+  }
+
+private:
+  std::vector<llvm::Value*> values;
+  llvm::DenseMap<const llvm::Value*, unsigned> slots;
+  llvm::DenseMap<const llvm::BasicBlock*, unsigned> blockIds;
+  std::vector<llvm::BasicBlock*> chains;
+  std::vector<unsigned> firstChainBlocks;
+  std::vector<unsigned> firstEvents;
+  std::vector<llvm::SmallVector<unsigned, 2>> predecessors;
+  std::vector<llvm::SmallVector<unsigned, 2>> successors;
+  std::vector<unsigned> postOrder;
+  std::vector<std::pair<unsigned, unsigned>> backEdges;
+
+  static llvm::BasicBlock*
+  getChainSuccessor(llvm::BasicBlock* bb) {
+    auto* successor = bb->getUniqueSuccessor();
+    if (!successor || successor == bb
+        || successor == &bb->getParent()->getEntryBlock()
+        || successor->getUniquePredecessor() != bb) {
+      return nullptr;
+    }
+    return successor;
+  }
+
+  void
+  addChain(llvm::BasicBlock* head) {
+    unsigned block = firstChainBlocks.size();
+    slots[head] = values.size();
+    values.push_back(head);
+    firstChainBlocks.push_back(chains.size());
+    for (auto* bb = head; bb && !blockIds.count(bb); bb = getChainSuccessor(bb)) {
+      blockIds[bb] = block;
+      chains.push_back(bb);
+    }
+  }
+
+  void
+  collapseChains(llvm::Function& f) {
+    // A block heads a chain unless it is the chain successor of its unique
+    // predecessor. Cycles of chain successors are only possible in
+    // unreachable code and are cut at their first block in layout order.
+    for (auto& bb : f) {
+      auto* predecessor = bb.getUniquePredecessor();
+      if (!predecessor || getChainSuccessor(predecessor) != &bb) {
+        addChain(&bb);
+      }
+    }
+    for (auto& bb : f) {
+      if (!blockIds.count(&bb)) {
+        addChain(&bb);
+      }
+    }
+    firstChainBlocks.push_back(chains.size());
+  }
+
+  void
+  computePostOrder() {
+    enum : char { kUnvisited, kOnStack, kDone };
+    std::vector<char> marks(getNumBlocks(), kUnvisited);
+    std::vector<std::pair<unsigned, unsigned>> stack{{0, 0}};
+    marks[0] = kOnStack;
+    while (!stack.empty()) {
+      auto& [block, next] = stack.back();
+      if (next == successors[block].size()) {
+        marks[block] = kDone;
+        postOrder.push_back(block);
+        stack.pop_back();
+        continue;
+      }
+      unsigned successor = successors[block][next++];
+      if (marks[successor] == kOnStack) {
+        backEdges.push_back({block, successor});
+      } else if (marks[successor] == kUnvisited) {
+        marks[successor] = kOnStack;
+        stack.push_back({successor, 0});
+      }
+    }
+  }
+};
+
+
+} // end namespace
+
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef KERNEL_MODULE_H
+#define KERNEL_MODULE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include "stream_intrinsics.h"
+
+
+namespace softbrain {
+
+
+namespace detail {
+
+
+inline llvm::Function*
+getDirectCallee(llvm::CallSite cs) {
+  return llvm::dyn_cast<llvm::Function>(cs.getCalledValue()->stripPointerCasts());
+}
+
+
+// Whether some path from the entry of `f` reaches a return without passing a
+// call of a function that never returns. Calls of functions outside of
+// `returning` are taken to never return, unless the callee is a declaration.
+inline bool
+canReturn(llvm::Function& f,
+          const llvm::DenseSet<llvm::Function*>& returning) {
+  auto passable = [&returning] (llvm::BasicBlock* bb) {
+    for (auto& i : *bb) {
+      llvm::CallSite cs(&i);
+      if (!cs.getInstruction()) {
+        continue;
+      }
+      auto* callee = getDirectCallee(cs);
+      if (callee && !callee->isDeclaration() && !returning.count(callee)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  llvm::DenseSet<llvm::BasicBlock*> seen;
+  llvm::SmallVector<llvm::BasicBlock*, 16> work{&f.getEntryBlock()};
+  seen.insert(&f.getEntryBlock());
+  while (!work.empty()) {
+    auto* bb = work.pop_back_val();
+    if (!passable(bb)) {
+      continue;
+    }
+    if (llvm::isa<llvm::ReturnInst>(bb->getTerminator())) {
+      return true;
+    }
+    for (auto* successor : llvm::successors(bb)) {
+      if (seen.insert(successor).second) {
+        work.push_back(successor);
+      }
+    }
+  }
+  return false;
+}
+
+
+} // end namespace detail
+
+
+// Parses the IR in `buffer` and keeps only the code that the tools look at
+// when they start from `roots`: the bodies of the functions that are called,
+// directly or transitively, from a root and that can reach a stream
+// intrinsic. Bitcode is loaded lazily, so the bodies of functions that are not
+// called from a root are never parsed at all.
+//
+// The bodies of the called functions that cannot reach an intrinsic are
+// dropped after they have been scanned. Such a function leaves the stream
+// state unchanged if it returns, which is also how the tools treat a
+// declaration, so it becomes one. If it can never return, the state after a
+// call of it is unreachable, so its body is replaced by a lone `unreachable`
+// instead. Either way, the analysis of the remaining code is unchanged.
+// Textual IR is pruned in the same way after it has been parsed completely.
+//
+// Roots that are not defined in the module are ignored, and the module is
+// loaded completely if there are no roots. As with llvm::parseIRFile, errors
+// are reported through `err` and yield no module.
+inline std::unique_ptr<llvm::Module>
+loadKernelModule(std::unique_ptr<llvm::MemoryBuffer> buffer,
+                 llvm::ArrayRef<std::string> roots,
+                 llvm::SMDiagnostic& err, llvm::LLVMContext& context) {
+  std::string path = buffer->getBufferIdentifier().str();
+  std::unique_ptr<llvm::Module> module =
+    llvm::getLazyIRModule(std::move(buffer), err, context);
+  if (!module) {
+    return nullptr;
+  }
+
+  auto fail = [&err, &path] (llvm::Error error) {
+    err = llvm::SMDiagnostic{path, llvm::SourceMgr::DK_Error,
+                             llvm::toString(std::move(error))};
+    return nullptr;
+  };
+
+  if (roots.empty()) {
+    if (auto error = module->materializeAll()) {
+      return fail(std::move(error));
+    }
+    return module;
+  }
+
+  // Walk the direct calls from the roots, reading each function's body when
+  // it is first reached, and remember the reverse call edges.
+  StreamIntrinsics sb{*module};
+  llvm::DenseMap<llvm::Function*, llvm::SmallVector<llvm::Function*, 4>> callers;
+  llvm::DenseSet<llvm::Function*> loaded;
+  std::vector<llvm::Function*> order;
+  std::vector<llvm::Function*> work;
+  std::vector<llvm::Function*> reaching;
+
+  auto load = [&loaded, &work] (llvm::Function* f) {
+    if (f && loaded.insert(f).second) {
+      work.push_back(f);
+    }
+  };
+  for (auto& name : roots) {
+    load(module->getFunction(name));
+  }
+
+  while (!work.empty()) {
+    auto* f = work.back();
+    work.pop_back();
+    if (auto error = f->materialize()) {
+      return fail(std::move(error));
+    }
+    if (f->isDeclaration() || sb.lookup(f)) {
+      continue;
+    }
+    order.push_back(f);
+
+    for (auto& i : llvm::instructions(*f)) {
+      llvm::CallSite cs(&i);
+      if (!cs.getInstruction()) {
+        continue;
+      }
+      auto* callee = detail::getDirectCallee(cs);
+      if (sb.lookup(cs)) {
+        reaching.push_back(f);
+      } else if (callee) {
+        callers[callee].push_back(f);
+      }
+      load(callee);
+    }
+  }
+
+  llvm::DenseSet<llvm::Function*> kept;
+  while (!reaching.empty()) {
+    auto* f = reaching.back();
+    reaching.pop_back();
+    if (kept.insert(f).second) {
+      auto& fCallers = callers[f];
+      reaching.insert(reaching.end(), fCallers.begin(), fCallers.end());
+    }
+  }
+  // The roots are analyzed even if they stream nothing, so they keep their
+  // bodies, too.
+  for (auto& name : roots) {
+    auto* root = module->getFunction(name);
+    if (root && !root->isDeclaration() && !sb.lookup(root)) {
+      kept.insert(root);
+    }
+  }
+
+  // The called functions that return, as a least fixed point so that
+  // functions which only recurse into themselves do not.
+  llvm::DenseSet<llvm::Function*> returning;
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (auto* f : order) {
+      if (!returning.count(f) && detail::canReturn(*f, returning)) {
+        returning.insert(f);
+        changed = true;
+      }
+    }
+  }
+
+  for (auto& f : *module) {
+    if (kept.count(&f) || (loaded.count(&f) && sb.lookup(&f))) {
+      continue;
+    }
+    if (!f.isMaterializable() && f.isDeclaration()) {
+      continue;
+    }
+    bool neverReturns = loaded.count(&f) && !returning.count(&f);
+    f.deleteBody();
+    if (neverReturns) {
+      auto* bb = llvm::BasicBlock::Create(context, "", &f);
+      new llvm::UnreachableInst{context, bb};
+    }
+  }
+  return module;
+}
+
+
+// Reads the IR file at `path`, or stdin for "-", as above.
+inline std::unique_ptr<llvm::Module>
+loadKernelModule(llvm::StringRef path, llvm::ArrayRef<std::string> roots,
+                 llvm::SMDiagnostic& err, llvm::LLVMContext& context) {
+  auto buffer = llvm::MemoryBuffer::getFileOrSTDIN(path);
+  if (!buffer) {
+    err = llvm::SMDiagnostic{path, llvm::SourceMgr::DK_Error,
+      "Could not open input file: " + buffer.getError().message()};
+    return nullptr;
+  }
+  return loadKernelModule(std::move(*buffer), roots, err, context);
+}
+
+
+} // end namespace
+
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef LOOP_SUMMARIES_H
+#define LOOP_SUMMARIES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Module.h"
+
+#include "stream_intrinsics.h"
+
+
+namespace softbrain {
+
+
+// The number of elements a piece of code adds to each port, indexed from 0.
+using PortDeltas = std::vector<int64_t>;
+
+using BlockDeltas = llvm::DenseMap<llvm::BasicBlock*, PortDeltas>;
+
+
+// The effect of a loop on the ports: `deltas`, plus each of `multiples` as
+// often as the loop iterates when that is not a constant.
+struct LoopEffect {
+  PortDeltas deltas;
+  std::vector<PortDeltas> multiples;
+};
+
+
+// Closed-form summaries of the loops of a module whose effect on the ports
+// does not depend on the state they are entered with. Such a loop adds the
+// same delta to the ports on every iteration, so its effect is that delta
+// times the trip count that ScalarEvolution computes, and the analysis can
+// apply it once at the loop exit instead of iterating the loop to a fixpoint.
+//
+// A loop is summarized if
+//   - it has a single exiting block that runs on every iteration, a latch and
+//     a unique exit block that is only reached from the loop,
+//   - it contains no SB_CONFIG, no SB_WAIT, and no calls of functions that
+//     the analysis descends into,
+//   - every block whose commands change the balance of the ports runs once
+//     on every iteration, and their element counts are constant, and
+//   - all of its inner loops are summarized.
+// Blocks before the exiting block run once more than the back edge is taken,
+// the others as often as it is. The domains are normalized modulo an equal
+// number of elements on all ports, so the trip count does not matter for a
+// loop that adds the same number of elements to all ports per iteration.
+// Otherwise, the trip count must be a constant, unless the domain can add
+// the per-iteration delta any number of times (`symbolicTripCounts`), as the
+// affine domain does with a new counter. Then symbolic and unknown trip
+// counts are fine, too, and the delta becomes one of the multiples.
+//
+// ScalarEvolution only sees induction variables in SSA form, so loops whose
+// counters live in allocas, as in unoptimized code, need the trip count to
+// not matter, or are otherwise iterated as before.
+class LoopSummaries {
+public:
+  LoopSummaries(llvm::Module& module, const StreamIntrinsics& sb,
+                unsigned numPorts, bool symbolicTripCounts = false)
+    : sb{sb},
+      numPorts{numPorts},
+      symbolicTripCounts{symbolicTripCounts} {
+    for (auto& f : module) {
+      if (!f.isDeclaration() && !sb.lookup(&f)) {
+        summarizeFunction(f);
+      }
+    }
+  }
+
+  // Whether `i` lies in a summarized loop, whose summary already includes the
+  // effect of `i` if it is a stream command.
+  bool
+  isSummarized(const llvm::Instruction& i) const {
+    return summarizedBlocks.count(i.getParent());
+  }
+
+  // The effect of the summarized loop that exits right before `i`, if any.
+  const LoopEffect*
+  getExitEffect(const llvm::Instruction& i) const {
+    auto found = exitEffects.find(&i);
+    return found == exitEffects.end() ? nullptr : &found->second;
+  }
+
+  // The number of outermost summarized loops.
+  std::size_t size() const { return exitEffects.size(); }
+
+private:
+  const StreamIntrinsics& sb;
+  unsigned numPorts;
+  bool symbolicTripCounts;
+  llvm::DenseSet<const llvm::BasicBlock*> summarizedBlocks;
+  llvm::DenseMap<const llvm::Instruction*, LoopEffect> exitEffects;
+
+  using ExitEffects = llvm::DenseMap<llvm::BasicBlock*, LoopEffect>;
+
+  struct FunctionLoops {
+    llvm::DominatorTree& dt;
+    llvm::LoopInfo& li;
+    llvm::ScalarEvolution& se;
+    // The summaries of the loops that are not nested in a summarized loop,
+    // by their exit blocks.
+    ExitEffects atExit;
+  };
+
+  void
+  summarizeFunction(llvm::Function& f) {
+    llvm::DominatorTree dt{f};
+    llvm::LoopInfo li{dt};
+    if (li.empty()) {
+      return;
+    }
+    llvm::TargetLibraryInfoImpl tlii{llvm::Triple{f.getParent()->getTargetTriple()}};
+    llvm::TargetLibraryInfo tli{tlii};
+    llvm::AssumptionCache ac{f};
+    llvm::ScalarEvolution se{f, tli, ac, dt, li};
+
+    FunctionLoops loops{dt, li, se, ExitEffects()};
+    for (auto* loop : li) {
+      summarize(*loop, loops);
+    }
+    for (auto& [exit, effect] : loops.atExit) {
+      exitEffects[&*exit->getFirstInsertionPt()] = std::move(effect);
+    }
+  }
+
+  // Summarizes `loop` and, innermost first, its inner loops, and returns the
+  // effect of `loop` if it could be summarized.
+  std::optional<LoopEffect>
+  summarize(llvm::Loop& loop, FunctionLoops& loops) {
+    // The blocks of `loop` itself, not of an inner loop, that change the
+    // ports. The effect of an inner loop belongs to its exit block, except
+    // for its multiples, which any number of iterations of `loop` add up to
+    // any multiples again.
+    BlockDeltas blockDeltas;
+    LoopEffect effect;
+    bool summarizable = true;
+    for (auto* inner : loop.getSubLoops()) {
+      auto innerEffect = summarize(*inner, loops);
+      auto* innerExit = inner->getUniqueExitBlock();
+      if (!innerEffect || loops.li.getLoopFor(innerExit) != &loop) {
+        summarizable = false;
+        continue;
+      }
+      add(deltasOf(blockDeltas, innerExit), innerEffect->deltas);
+      for (auto& multiple : innerEffect->multiples) {
+        effect.multiples.push_back(std::move(multiple));
+      }
+    }
+
+    auto* exiting = loop.getExitingBlock();
+    auto* latch = loop.getLoopLatch();
+    auto* exit = loop.getUniqueExitBlock();
+    if (!summarizable || !exiting || !latch || !exit
+        || !loop.hasDedicatedExits() || !loops.dt.dominates(exiting, latch)
+        || exit->getFirstInsertionPt() == exit->end()
+        || isAnalyzedCall(*exit->getFirstInsertionPt())) {
+      return std::nullopt;
+    }
+
+    for (auto* bb : loop.blocks()) {
+      if (loops.li.getLoopFor(bb) != &loop) {
+        continue;
+      }
+      for (auto& i : *bb) {
+        llvm::CallSite cs(&i);
+        auto* intrinsic = sb.lookup(cs);
+        if (!intrinsic) {
+          if (cs.getInstruction() && isAnalyzedCall(i)) {
+            return std::nullopt;
+          }
+          continue;
+        }
+        if (intrinsic->kind == IntrinsicKind::Config
+            || intrinsic->kind == IntrinsicKind::Wait) {
+          return std::nullopt;
+        }
+        if (!intrinsic->hasPort()) {
+          continue;
+        }
+        auto port = getConstantArgument(cs, intrinsic->portArgument);
+        auto nelems = getElementCount(*intrinsic, cs);
+        if (!port || !nelems || *port < 1 || *port > numPorts
+            || *nelems > (uint64_t)kMaxDelta) {
+          return std::nullopt;
+        }
+        deltasOf(blockDeltas, bb)[*port - 1] += *nelems;
+      }
+    }
+
+    PortDeltas perIteration(numPorts), beforeExit(numPorts);
+    for (auto& [bb, deltas] : blockDeltas) {
+      if (isUniform(deltas)) {
+        continue;
+      }
+      if (!loops.dt.dominates(bb, latch)) {
+        return std::nullopt;
+      }
+      add(perIteration, deltas);
+      if (loops.dt.dominates(bb, exiting)) {
+        add(beforeExit, deltas);
+      }
+    }
+
+    effect.deltas = beforeExit;
+    if (!isUniform(perIteration)) {
+      auto* taken = llvm::dyn_cast<llvm::SCEVConstant>(
+        loops.se.getBackedgeTakenCount(&loop));
+      if (!taken || taken->getAPInt().getActiveBits() > 32) {
+        if (!symbolicTripCounts
+            || *std::max_element(perIteration.begin(), perIteration.end())
+                 > kMaxDelta) {
+          return std::nullopt;
+        }
+        effect.multiples.push_back(perIteration);
+      } else {
+        int64_t iterations = taken->getAPInt().getZExtValue();
+        for (unsigned p = 0; p < numPorts; p++) {
+          if (perIteration[p] > kMaxDelta
+              || iterations * perIteration[p] > kMaxDelta - effect.deltas[p]) {
+            return std::nullopt;
+          }
+          effect.deltas[p] += iterations * perIteration[p];
+        }
+      }
+    }
+    if (*std::max_element(effect.deltas.begin(), effect.deltas.end())
+          > kMaxDelta) {
+      return std::nullopt;
+    }
+
+    // The summary of `loop` subsumes those of its inner loops.
+    for (auto* inner : loop.getSubLoops()) {
+      loops.atExit.erase(inner->getUniqueExitBlock());
+    }
+    for (auto* bb : loop.blocks()) {
+      summarizedBlocks.insert(bb);
+    }
+    loops.atExit[exit] = effect;
+    return effect;
+  }
+
+  // Deltas are applied with AddAtPort, which takes an int.
+  static constexpr int64_t kMaxDelta = std::numeric_limits<int>::max();
+
+  PortDeltas&
+  deltasOf(BlockDeltas& blockDeltas, llvm::BasicBlock* bb) const {
+    auto& deltas = blockDeltas[bb];
+    deltas.resize(numPorts);
+    return deltas;
+  }
+
+  static void
+  add(PortDeltas& to, const PortDeltas& deltas) {
+    for (unsigned p = 0; p < to.size(); p++) {
+      to[p] += deltas[p];
+    }
+  }
+
+  static bool
+  isUniform(const PortDeltas& deltas) {
+    return std::all_of(deltas.begin(), deltas.end(),
+      [&deltas] (int64_t delta) { return delta == deltas.front(); });
+  }
+
+  // Whether the analysis descends into the callee of `i`.
+  bool
+  isAnalyzedCall(llvm::Instruction& i) const {
+    llvm::CallSite cs(&i);
+    if (!cs.getInstruction() || sb.lookup(cs)) {
+      return false;
+    }
+    auto* callee = llvm::dyn_cast<llvm::Function>(
+      cs.getCalledValue()->stripPointerCasts());
+    return callee && !callee->isDeclaration();
+  }
+};
+
+
+} // end namespace
+
+
+#endif
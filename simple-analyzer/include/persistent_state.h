@@ -0,0 +1,246 @@
+#ifndef PERSISTENT_STATE_H
+#define PERSISTENT_STATE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "llvm/IR/Value.h"
+
+
+namespace analysis {
+
+
+// A map from Values to abstract values stored as a flat array of pairs
+// sorted by key. Abstract states only hold a handful of values, so a
+// binary search over a contiguous array is cheaper than hashing, and
+// copying, comparing and iterating a state touches a single allocation.
+// The interface mirrors the subset of llvm::DenseMap used by the analysis.
+template <typename AbstractValue>
+class FlatValueMap {
+public:
+  using value_type     = std::pair<llvm::Value*, AbstractValue>;
+  using iterator       = typename std::vector<value_type>::iterator;
+  using const_iterator = typename std::vector<value_type>::const_iterator;
+
+  bool empty() const { return entries.empty(); }
+  unsigned size() const { return entries.size(); }
+
+  iterator begin() { return entries.begin(); }
+  iterator end() { return entries.end(); }
+  const_iterator begin() const { return entries.begin(); }
+  const_iterator end() const { return entries.end(); }
+
+  iterator
+  find(const llvm::Value* v) {
+    auto position = lowerBound(v);
+    return (position != end() && position->first == v) ? position : end();
+  }
+
+  const_iterator
+  find(const llvm::Value* v) const {
+    return const_cast<FlatValueMap*>(this)->find(v);
+  }
+
+  unsigned count(const llvm::Value* v) const { return find(v) != end(); }
+
+  std::pair<iterator, bool>
+  insert(const value_type& kvPair) {
+    auto position = lowerBound(kvPair.first);
+    if (position != end() && position->first == kvPair.first) {
+      return {position, false};
+    }
+    return {entries.insert(position, kvPair), true};
+  }
+
+  value_type&
+  FindAndConstruct(llvm::Value* v) {
+    return *insert({v, AbstractValue()}).first;
+  }
+
+  AbstractValue& operator[](llvm::Value* v) { return FindAndConstruct(v).second; }
+
+  bool
+  erase(const llvm::Value* v) {
+    auto found = find(v);
+    if (found == end()) {
+      return false;
+    }
+    entries.erase(found);
+    return true;
+  }
+
+private:
+  std::vector<value_type> entries;
+
+  iterator
+  lowerBound(const llvm::Value* v) {
+    return std::lower_bound(entries.begin(), entries.end(), v,
+      [] (const value_type& kvPair, const llvm::Value* key) {
+        return kvPair.first < key;
+      });
+  }
+};
+
+
+// A PersistentState is a map from LLVM Values to abstract values with value
+// semantics and copy-on-write storage. Copying a state only bumps a reference
+// count, so snapshotting the state after every instruction is O(1) and all
+// consecutive instructions that do not modify the state share one map. The
+// underlying map is cloned lazily, the first time a shared state is mutated.
+//
+// Only the mutating accessors (operator[], insert, FindAndConstruct, erase)
+// may clone. All lookups go through the const interface and never copy.
+template <typename AbstractValue>
+class PersistentState {
+public:
+  using Map            = FlatValueMap<AbstractValue>;
+  using value_type     = typename Map::value_type;
+  using iterator       = typename Map::iterator;
+  using const_iterator = typename Map::const_iterator;
+
+  PersistentState() = default;
+
+  bool empty() const { return getMap().empty(); }
+  unsigned size() const { return getMap().size(); }
+
+  const_iterator begin() const { return getMap().begin(); }
+  const_iterator end() const { return getMap().end(); }
+
+  const_iterator find(const llvm::Value* v) const {
+    return getMap().find(v);
+  }
+
+  unsigned count(const llvm::Value* v) const {
+    return getMap().count(v);
+  }
+
+  AbstractValue&
+  operator[](llvm::Value* v) {
+    return getMutableMap()[v];
+  }
+
+  std::pair<iterator, bool>
+  insert(const value_type& kvPair) {
+    return getMutableMap().insert(kvPair);
+  }
+
+  value_type&
+  FindAndConstruct(llvm::Value* v) {
+    return getMutableMap().FindAndConstruct(v);
+  }
+
+  bool
+  erase(llvm::Value* v) {
+    return count(v) && getMutableMap().erase(v);
+  }
+
+  bool
+  operator==(const PersistentState& other) const {
+    // States derived from one another without intervening mutations share
+    // storage, which makes the common "nothing changed" check O(1).
+    if (storage == other.storage) {
+      return true;
+    }
+    // Both maps are sorted by key, so they can be compared pairwise.
+    if (size() != other.size()) {
+      return false;
+    }
+    return std::equal(begin(), end(), other.begin(),
+      [] (auto& kvPair, auto& otherPair) {
+        return kvPair.first == otherPair.first
+            && kvPair.second == otherPair.second;
+      });
+  }
+
+  bool
+  operator!=(const PersistentState& other) const {
+    return !(*this == other);
+  }
+
+private:
+  std::shared_ptr<Map> storage;
+
+  static const Map&
+  getEmptyMap() {
+    static const Map emptyMap;
+    return emptyMap;
+  }
+
+  const Map&
+  getMap() const {
+    return storage ? *storage : getEmptyMap();
+  }
+
+  Map&
+  getMutableMap() {
+    if (!storage) {
+      storage = std::make_shared<Map>();
+    } else if (storage.use_count() > 1) {
+      storage = std::make_shared<Map>(*storage);
+    }
+    return *storage;
+  }
+};
+
+
+// The state of an analysis that tracks a single fact per program point rather
+// than one per Value, e.g. the port counts of the balance analysis. It has the
+// same copy-on-write storage as a PersistentState, but no keys to hash or
+// search: the fact is the one a map-based state would keep under nullptr, and
+// it is accessed as `state[nullptr]` for the same reason. A state without a
+// fact is empty, like a map without that key.
+template <typename AbstractValue>
+class SingleFactState {
+public:
+  SingleFactState() = default;
+
+  bool empty() const { return !storage; }
+  unsigned size() const { return storage ? 1 : 0; }
+
+  // The fact, or the default AbstractValue if there is none.
+  const AbstractValue&
+  get() const {
+    return storage ? *storage : getDefault();
+  }
+
+  AbstractValue&
+  operator[](std::nullptr_t) {
+    if (!storage) {
+      storage = std::make_shared<AbstractValue>();
+    } else if (storage.use_count() > 1) {
+      storage = std::make_shared<AbstractValue>(*storage);
+    }
+    return *storage;
+  }
+
+  bool
+  operator==(const SingleFactState& other) const {
+    if (storage == other.storage) {
+      return true;
+    }
+    return storage && other.storage && *storage == *other.storage;
+  }
+
+  bool
+  operator!=(const SingleFactState& other) const {
+    return !(*this == other);
+  }
+
+private:
+  std::shared_ptr<AbstractValue> storage;
+
+  static const AbstractValue&
+  getDefault() {
+    static const AbstractValue defaultValue;
+    return defaultValue;
+  }
+};
+
+
+} // end namespace
+
+
+#endif
@@ -0,0 +1,401 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+namespace analysis {
+
+
+// Bumped whenever a change to the solver or to a domain changes the results
+// computed for the same IR, which invalidates all cached results.
+constexpr unsigned kResultCacheVersion = 4;
+
+
+// Cached results are stored as whitespace separated tokens: integers, and
+// strings prefixed by their length as in `4:main`. Abstract values that can be
+// cached provide
+//
+//     void encode(CacheWriter& out) const;
+//     static bool decode(CacheReader& in, AbstractValue& value);
+//
+// with decode returning false if the input is malformed.
+class CacheWriter {
+public:
+  explicit CacheWriter(llvm::raw_ostream& out)
+    : out{out}
+      { }
+
+  void write(int64_t value) { out << value << ' '; }
+  void write(llvm::StringRef value) { out << value.size() << ':' << value << ' '; }
+
+private:
+  llvm::raw_ostream& out;
+};
+
+
+class CacheReader {
+public:
+  explicit CacheReader(llvm::StringRef input)
+    : rest{input}
+      { }
+
+  bool
+  read(int64_t& value) {
+    rest = rest.ltrim();
+    return !rest.consumeInteger(10, value);
+  }
+
+  bool
+  read(llvm::StringRef& value) {
+    int64_t size;
+    if (!read(size) || size < 0 || !rest.consume_front(":")
+        || rest.size() < (uint64_t)size) {
+      return false;
+    }
+    value = rest.take_front(size);
+    rest = rest.drop_front(size);
+    return true;
+  }
+
+  bool atEnd() const { return rest.ltrim().empty(); }
+
+private:
+  llvm::StringRef rest;
+};
+
+
+// Whether AbstractValue can be cached, i.e. provides encode() and decode().
+template <typename AbstractValue, typename = void>
+struct IsCacheable : std::false_type { };
+
+template <typename AbstractValue>
+struct IsCacheable<AbstractValue, std::void_t<
+    decltype(std::declval<const AbstractValue&>().encode(
+      std::declval<CacheWriter&>())),
+    decltype(AbstractValue::decode(std::declval<CacheReader&>(),
+                                   std::declval<AbstractValue&>()))>>
+  : std::true_type { };
+
+
+// A directory of cached analysis results. Entries are addressed by a key
+// string and stored in files named by the MD5 of the salt and the key. Every
+// file repeats its salt and key, so that a hash collision is a miss rather
+// than a wrong result. Entries are written to a temporary file first and
+// renamed into place, which makes concurrent readers and writers safe, also
+// across processes sharing the directory.
+//
+// Without a directory, entries are kept in memory for the lifetime of the
+// cache instead, e.g. by a server that analyzes new versions of the same
+// module over and over. Once they take up more than `memoryLimit` bytes, the
+// least recently used entries are evicted.
+class ResultCache {
+public:
+  // `salt` identifies everything that results depend on besides the IR,
+  // e.g. the analyzer version and its options.
+  ResultCache(std::string directory, std::string salt,
+              std::size_t memoryLimit = 64 << 20)
+    : directory{std::move(directory)},
+      salt{std::move(salt)},
+      memoryLimit{memoryLimit} {
+    if (!this->directory.empty()) {
+      llvm::sys::fs::create_directories(this->directory);
+    }
+  }
+
+  // Lookups and stores, counted so that clients can report them.
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> stores{0};
+
+  std::optional<std::string>
+  load(llvm::StringRef key) {
+    if (directory.empty()) {
+      std::lock_guard<std::mutex> guard{memoryLock};
+      auto found = memory.find(key);
+      if (found == memory.end()) {
+        return std::nullopt;
+      }
+      recent.splice(recent.begin(), recent, found->second.position);
+      return found->second.data;
+    }
+
+    auto buffer = llvm::MemoryBuffer::getFile(getPath(key));
+    if (buffer) {
+      CacheReader in{(*buffer)->getBuffer()};
+      llvm::StringRef storedSalt, storedKey, data;
+      if (in.read(storedSalt) && storedSalt == salt
+          && in.read(storedKey) && storedKey == key && in.read(data)) {
+        return data.str();
+      }
+    }
+    return std::nullopt;
+  }
+
+  void
+  store(llvm::StringRef key, llvm::StringRef data) {
+    if (directory.empty()) {
+      std::lock_guard<std::mutex> guard{memoryLock};
+      storeInMemory(key, data);
+      stores.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    auto path = getPath(key);
+    llvm::SmallString<128> temporary;
+    int fd;
+    if (llvm::sys::fs::createUniqueFile(path + ".%%%%%%", fd, temporary)) {
+      return;
+    }
+    {
+      llvm::raw_fd_ostream out{fd, /*shouldClose=*/true};
+      CacheWriter writer{out};
+      writer.write(salt);
+      writer.write(key);
+      writer.write(data);
+    }
+    if (llvm::sys::fs::rename(temporary, path)) {
+      llvm::sys::fs::remove(temporary);
+      return;
+    }
+    stores.fetch_add(1, std::memory_order_relaxed);
+  }
+
+private:
+  struct MemoryEntry {
+    std::string data;
+    // The position of the key in `recent`.
+    std::list<llvm::StringRef>::iterator position;
+  };
+
+  std::string directory;
+  std::string salt;
+  std::size_t memoryLimit;
+  std::mutex memoryLock;
+  llvm::StringMap<MemoryEntry> memory;
+  // The keys of `memory`, most recently used first.
+  std::list<llvm::StringRef> recent;
+  std::size_t memorySize = 0;
+
+  void
+  storeInMemory(llvm::StringRef key, llvm::StringRef data) {
+    auto [found, inserted] = memory.try_emplace(key);
+    auto& entry = found->second;
+    if (inserted) {
+      recent.push_front(found->getKey());
+      memorySize += key.size();
+    } else {
+      recent.splice(recent.begin(), recent, entry.position);
+      memorySize -= entry.data.size();
+    }
+    entry.data = data.str();
+    entry.position = recent.begin();
+    memorySize += entry.data.size();
+
+    // The entry just stored is kept even if it alone exceeds the limit.
+    while (memorySize > memoryLimit && recent.size() > 1) {
+      auto evicted = memory.find(recent.back());
+      memorySize -= evicted->getKey().size() + evicted->second.data.size();
+      recent.pop_back();
+      memory.erase(evicted);
+    }
+  }
+
+  std::string
+  getPath(llvm::StringRef key) const {
+    llvm::MD5 md5;
+    md5.update(salt);
+    md5.update(llvm::StringRef{"\0", 1});
+    md5.update(key);
+    llvm::MD5::MD5Result digest;
+    md5.final(digest);
+
+    llvm::SmallString<128> path{directory};
+    llvm::sys::path::append(path, digest.digest());
+    return path.str().str();
+  }
+};
+
+
+// Names the values of a module in a way that survives recompilation, for use
+// in cache keys: functions and globals by name, and arguments, blocks and
+// instructions by their function and their position in it. Every function
+// with a body also gets a structural hash of its code, which changes with
+// its instructions, their types and operands, but not with the names of its
+// local values or with metadata. Whether a called function has a body is part
+// of the hash, since it decides whether the call is analyzed. Everything is
+// computed up front, so that the keys can be used from any number of threads
+// afterwards.
+class CacheKeys {
+public:
+  explicit CacheKeys(llvm::Module& module)
+    : module{module} {
+    for (auto& f : module) {
+      if (f.isDeclaration()) {
+        continue;
+      }
+      auto& local = locals[&f];
+      for (auto& bb : f) {
+        positions[&bb] = local.size();
+        local.push_back(&bb);
+      }
+      for (auto& i : llvm::instructions(f)) {
+        positions[&i] = local.size();
+        local.push_back(&i);
+      }
+      hashes[&f] = hashFunction(f);
+    }
+  }
+
+  llvm::StringRef
+  getHash(const llvm::Function& f) const {
+    auto found = hashes.find(&f);
+    return found == hashes.end() ? llvm::StringRef{} : found->second;
+  }
+
+  // Writes the key of `v`, or returns false if `v` has none.
+  bool
+  writeValue(CacheWriter& out, const llvm::Value* v) const {
+    if (!v) {
+      out.write("-");
+      return true;
+    }
+    if (auto* arg = llvm::dyn_cast<llvm::Argument>(v)) {
+      out.write("a");
+      out.write(arg->getParent()->getName());
+      out.write(arg->getArgNo());
+      return true;
+    }
+    if (llvm::isa<llvm::Instruction>(v) || llvm::isa<llvm::BasicBlock>(v)) {
+      auto* f = llvm::isa<llvm::Instruction>(v)
+        ? llvm::cast<llvm::Instruction>(v)->getFunction()
+        : llvm::cast<llvm::BasicBlock>(v)->getParent();
+      out.write("l");
+      out.write(f->getName());
+      out.write(positions.lookup(v));
+      return true;
+    }
+    if (auto* global = llvm::dyn_cast<llvm::GlobalValue>(v);
+        global && global->hasName()) {
+      out.write("g");
+      out.write(global->getName());
+      return true;
+    }
+    return false;
+  }
+
+  // Reads a key written by writeValue, returning false if it is malformed or
+  // names a value that does not exist.
+  bool
+  readValue(CacheReader& in, llvm::Value*& v) const {
+    llvm::StringRef kind, name;
+    if (!in.read(kind)) {
+      return false;
+    }
+    if (kind == "-") {
+      v = nullptr;
+      return true;
+    }
+    if (!in.read(name)) {
+      return false;
+    }
+    if (kind == "g") {
+      v = module.getNamedValue(name);
+      return v != nullptr;
+    }
+
+    auto* f = module.getFunction(name);
+    int64_t position;
+    if (!f || !in.read(position) || position < 0) {
+      return false;
+    }
+    if (kind == "a") {
+      if ((uint64_t)position >= f->arg_size()) {
+        return false;
+      }
+      v = std::next(f->arg_begin(), position);
+      return true;
+    }
+    auto found = locals.find(f);
+    if (kind != "l" || found == locals.end()
+        || (uint64_t)position >= found->second.size()) {
+      return false;
+    }
+    v = found->second[position];
+    return true;
+  }
+
+private:
+  llvm::Module& module;
+  llvm::DenseMap<const llvm::Function*, std::vector<llvm::Value*>> locals;
+  llvm::DenseMap<const llvm::Value*, unsigned> positions;
+  llvm::DenseMap<const llvm::Function*, std::string> hashes;
+
+  std::string
+  hashFunction(llvm::Function& f) const {
+    std::string text;
+    llvm::raw_string_ostream out{text};
+    f.getFunctionType()->print(out);
+    for (auto& i : llvm::instructions(f)) {
+      out << '\n' << i.getOpcodeName() << ' ';
+      i.getType()->print(out);
+      if (auto* cmp = llvm::dyn_cast<llvm::CmpInst>(&i)) {
+        out << ' ' << cmp->getPredicate();
+      }
+      for (auto& operand : i.operands()) {
+        out << ", ";
+        auto* v = operand.get();
+        if (llvm::isa<llvm::Instruction>(v) || llvm::isa<llvm::BasicBlock>(v)) {
+          out << '%' << positions.lookup(v);
+        } else if (auto* arg = llvm::dyn_cast<llvm::Argument>(v)) {
+          out << "arg" << arg->getArgNo();
+        } else if (auto* global = llvm::dyn_cast<llvm::GlobalValue>(v)) {
+          out << '@' << global->getName();
+          if (global->isDeclaration()) {
+            out << " declared";
+          }
+        } else if (auto* constant = llvm::dyn_cast<llvm::Constant>(v)) {
+          constant->print(out);
+        } else {
+          out << '?';
+        }
+      }
+    }
+
+    llvm::MD5 md5;
+    md5.update(out.str());
+    llvm::MD5::MD5Result digest;
+    md5.final(digest);
+    return digest.digest().str().str();
+  }
+};
+
+
+} // end namespace
+
+
+#endif
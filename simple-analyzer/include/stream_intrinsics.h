@@ -0,0 +1,174 @@
+#ifndef STREAM_INTRINSICS_H
+#define STREAM_INTRINSICS_H
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+
+
+namespace softbrain {
+
+
+enum class IntrinsicKind {
+  Config,
+  Wait,
+  MemPortStream,
+  Constant,
+  PortMemStream,
+  Discard,
+  MemScratchStream,
+  Barrier,
+};
+
+
+// How the number of elements that a command moves through its port follows
+// from the command's arguments.
+enum class ElementCount {
+  // The command does not move any elements.
+  None,
+  // An argument holds the element count.
+  Elements,
+  // nstrides * access_size / 8, i.e. the number of 8 byte elements in
+  // `nstrides` accesses of `access_size` bytes each.
+  Strided,
+};
+
+
+// A constant argument of a command that the tools report, in the order in
+// which they report them.
+struct ReportedArgument {
+  const char* name;
+  unsigned index;
+};
+
+
+// Describes one SB_* intrinsic of softbrain.h. Ports are numbered starting at
+// 1, and `portArgument` is -1 for commands that do not stream through a port.
+// For ElementCount::Elements, `countArguments[0]` holds the element count. For
+// ElementCount::Strided, `countArguments` are the access size and the number
+// of strides.
+struct IntrinsicDescriptor {
+  IntrinsicKind kind;
+  const char* name;
+  int portArgument;
+  ElementCount count;
+  std::array<unsigned, 2> countArguments;
+  std::array<ReportedArgument, 4> arguments;
+  unsigned numArguments;
+
+  constexpr bool hasPort() const { return portArgument >= 0; }
+};
+
+
+inline constexpr IntrinsicDescriptor kIntrinsics[] = {
+  {IntrinsicKind::Config, "SB_CONFIG", -1, ElementCount::None, {},
+   {}, 0},
+  {IntrinsicKind::Wait, "SB_WAIT", -1, ElementCount::None, {},
+   {}, 0},
+  {IntrinsicKind::MemPortStream, "SB_MEM_PORT_STREAM",
+   4, ElementCount::Strided, {2, 3},
+   {{{"port", 4}, {"stride", 1}, {"access_size", 2}, {"nstrides", 3}}}, 4},
+  {IntrinsicKind::Constant, "SB_CONSTANT",
+   0, ElementCount::Elements, {2, 0},
+   {{{"port", 0}, {"nelems", 2}}}, 2},
+  {IntrinsicKind::PortMemStream, "SB_PORT_MEM_STREAM",
+   0, ElementCount::Strided, {2, 3},
+   {{{"port", 0}, {"stride", 1}, {"access_size", 2}, {"nstrides", 3}}}, 4},
+  {IntrinsicKind::Discard, "SB_DISCARD",
+   0, ElementCount::Elements, {1, 0},
+   {{{"port", 0}, {"nelems", 1}}}, 2},
+  {IntrinsicKind::MemScratchStream, "SB_MEM_SCRATCH_STREAM",
+   -1, ElementCount::Strided, {2, 3},
+   {{{"addr", 4}, {"stride", 1}, {"access_size", 2}, {"nstrides", 3}}}, 4},
+  {IntrinsicKind::Barrier, "SB_BARRIER", -1, ElementCount::None, {},
+   {{{"type", 0}}}, 1},
+};
+
+
+constexpr const IntrinsicDescriptor*
+findIntrinsic(std::string_view name) {
+  for (auto& descriptor : kIntrinsics) {
+    if (name == descriptor.name) {
+      return &descriptor;
+    }
+  }
+  return nullptr;
+}
+
+// The value of a constant integer argument of a call, if it is one.
+inline std::optional<uint64_t>
+getConstantArgument(llvm::CallSite cs, unsigned index) {
+  if (auto* constant = llvm::dyn_cast<llvm::ConstantInt>(cs.getArgument(index))) {
+    return constant->getValue().getLimitedValue();
+  }
+  return std::nullopt;
+}
+
+
+// The number of elements that a call of the intrinsic moves, if its arguments
+// are constant.
+inline std::optional<uint64_t>
+getElementCount(const IntrinsicDescriptor& descriptor, llvm::CallSite cs) {
+  switch (descriptor.count) {
+  case ElementCount::None:
+    return 0;
+  case ElementCount::Elements:
+    return getConstantArgument(cs, descriptor.countArguments[0]);
+  case ElementCount::Strided: {
+    auto accessSize = getConstantArgument(cs, descriptor.countArguments[0]);
+    auto nstrides   = getConstantArgument(cs, descriptor.countArguments[1]);
+    if (!accessSize || !nstrides) {
+      return std::nullopt;
+    }
+    return *nstrides * *accessSize / 8;
+  }
+  }
+  llvm_unreachable("unknown element count");
+}
+
+
+// The SB_* functions of one module, resolved once against kIntrinsics. They
+// are looked up per module, so that modules in different LLVMContexts can be
+// analyzed at the same time. Like the stubs of softbrain.h, intrinsics must be
+// defined in the module; declarations are not treated as intrinsics.
+class StreamIntrinsics {
+public:
+  explicit StreamIntrinsics(llvm::Module& module) {
+    for (auto& descriptor : kIntrinsics) {
+      auto* function = module.getFunction(descriptor.name);
+      if (function && !function->isDeclaration()) {
+        descriptors[function] = &descriptor;
+      }
+    }
+  }
+
+  const IntrinsicDescriptor*
+  lookup(const llvm::Function* function) const {
+    return descriptors.lookup(function);
+  }
+
+  // The intrinsic called by `cs`, if any.
+  const IntrinsicDescriptor*
+  lookup(llvm::CallSite cs) const {
+    if (!cs.getInstruction()) {
+      return nullptr;
+    }
+    auto* called = cs.getCalledValue()->stripPointerCasts();
+    return lookup(llvm::dyn_cast<llvm::Function>(called));
+  }
+
+private:
+  llvm::DenseMap<const llvm::Function*, const IntrinsicDescriptor*> descriptors;
+};
+
+
+} // end namespace
+
+
+#endif
@@ -0,0 +1,349 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Value.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+namespace analysis {
+
+
+// Trace levels are cumulative: enabling a level enables all levels below it.
+enum class TraceLevel : uint8_t {
+  Off,
+  // Every interpretation of an intrinsic-like call by a transfer.
+  Commands,
+  // Every (context, function) item solved by a DataflowAnalysis.
+  Solver,
+  // Every block visited while solving a function.
+  Blocks,
+};
+
+
+// One recorded event. Events are plain data, so recording one does not
+// format, allocate or flush anything. `name` must be a string with static
+// storage duration, and `subject` is the IR value the event is about.
+struct TraceEvent {
+  static constexpr unsigned kMaxArgs = 4;
+
+  uint64_t timestamp;
+  uint64_t duration;
+  const char* name;
+  const llvm::Value* subject;
+  std::array<uint64_t, kMaxArgs> args;
+  uint8_t numArgs;
+  TraceLevel level;
+  bool isSpan;
+};
+
+
+// A Tracer collects events into one ring buffer per recording thread. Once a
+// buffer is full, the oldest events of that thread are overwritten. Events
+// are exported after the traced work has finished, either in a compact binary
+// format or as Chrome trace-event JSON (chrome://tracing, Perfetto).
+//
+// isEnabled() is a single comparison, so trace points cost next to nothing
+// while tracing is off.
+class Tracer {
+public:
+  explicit Tracer(TraceLevel level, unsigned eventsPerThread = 1 << 16)
+    : level{level},
+      capacity{llvm::PowerOf2Ceil(std::max(eventsPerThread, 1u))},
+      id{nextId.fetch_add(1)},
+      start{Clock::now()}
+      { }
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  bool isEnabled(TraceLevel l) const { return l != TraceLevel::Off && l <= level; }
+
+  uint64_t
+  now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count();
+  }
+
+  // Records an instant event.
+  void
+  record(TraceLevel l, const char* name, const llvm::Value* subject,
+         llvm::ArrayRef<uint64_t> args = {}) {
+    if (isEnabled(l)) {
+      getBuffer().add(makeEvent(l, name, subject, args, now(), 0, false));
+    }
+  }
+
+  // Records an event that started at `begin` (as returned by now()) and
+  // lasted until now.
+  void
+  recordSpan(TraceLevel l, const char* name, const llvm::Value* subject,
+             uint64_t begin, llvm::ArrayRef<uint64_t> args = {}) {
+    if (isEnabled(l)) {
+      getBuffer().add(
+        makeEvent(l, name, subject, args, begin, now() - begin, true));
+    }
+  }
+
+  // The binary format is little endian:
+  //
+  //   "BALTRACE" u32 version
+  //   u32 numNames, numNames x (u16 length, bytes)
+  //   u32 numThreads, numThreads x (u64 dropped, u64 numEvents,
+  //       numEvents x (u64 timestamp, u64 duration, u16 name, u8 level,
+  //                    u8 isSpan, u8 numArgs, u64 subject, numArgs x u64))
+  //
+  // Timestamps and durations are in nanoseconds and subjects are the
+  // addresses of the traced values. Instant events have a duration of 0.
+  void
+  writeBinary(llvm::raw_ostream& out) const {
+    std::lock_guard<std::mutex> guard{buffersLock};
+    llvm::DenseMap<const char*, uint16_t> nameIds;
+    std::vector<const char*> names;
+    for (auto& buffer : buffers) {
+      buffer->forEach([&] (const TraceEvent& event) {
+        if (nameIds.insert({event.name, names.size()}).second) {
+          names.push_back(event.name);
+        }
+      });
+    }
+
+    out << "BALTRACE";
+    write<uint32_t>(out, 1);
+    write<uint32_t>(out, names.size());
+    for (auto* name : names) {
+      llvm::StringRef text{name};
+      write<uint16_t>(out, text.size());
+      out << text;
+    }
+    write<uint32_t>(out, buffers.size());
+    for (auto& buffer : buffers) {
+      write<uint64_t>(out, buffer->getDropped());
+      write<uint64_t>(out, buffer->size());
+      buffer->forEach([&] (const TraceEvent& event) {
+        write<uint64_t>(out, event.timestamp);
+        write<uint64_t>(out, event.duration);
+        write<uint16_t>(out, nameIds[event.name]);
+        write<uint8_t>(out, static_cast<uint8_t>(event.level));
+        write<uint8_t>(out, event.isSpan);
+        write<uint8_t>(out, event.numArgs);
+        write<uint64_t>(out, reinterpret_cast<uintptr_t>(event.subject));
+        for (unsigned i = 0; i < event.numArgs; ++i) {
+          write<uint64_t>(out, event.args[i]);
+        }
+      });
+    }
+  }
+
+  // Writes the events in the JSON object format of the Chrome trace viewer.
+  // Subjects are exported by name, so the IR must still be alive.
+  void
+  writeChromeJson(llvm::raw_ostream& out) const {
+    std::lock_guard<std::mutex> guard{buffersLock};
+    uint64_t dropped = 0;
+    bool first = true;
+    out << "{\"traceEvents\":[";
+    for (unsigned thread = 0; thread < buffers.size(); ++thread) {
+      dropped += buffers[thread]->getDropped();
+      buffers[thread]->forEach([&] (const TraceEvent& event) {
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "{\"name\":\"" << event.name << "\",\"ph\":\""
+            << (event.isSpan ? 'X' : 'i') << "\",\"ts\":";
+        writeMicroseconds(out, event.timestamp);
+        if (event.isSpan) {
+          out << ",\"dur\":";
+          writeMicroseconds(out, event.duration);
+        } else {
+          out << ",\"s\":\"t\"";
+        }
+        out << ",\"pid\":0,\"tid\":" << thread << ",\"args\":{";
+        if (event.subject) {
+          out << "\"subject\":\"";
+          writeSubject(out, *event.subject);
+          out << '"';
+        }
+        for (unsigned i = 0; i < event.numArgs; ++i) {
+          out << (i || event.subject ? "," : "") << "\"arg" << i << "\":"
+              << event.args[i];
+        }
+        out << "}}";
+      });
+    }
+    out << "\n],\"otherData\":{\"droppedEvents\":" << dropped << "}}\n";
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  class Buffer {
+  public:
+    explicit Buffer(std::size_t capacity)
+      : events(capacity)
+      { }
+
+    void
+    add(const TraceEvent& event) {
+      events[written++ & (events.size() - 1)] = event;
+    }
+
+    std::size_t size() const { return std::min<uint64_t>(written, events.size()); }
+    uint64_t getDropped() const { return written - size(); }
+
+    // Visits the retained events, oldest first.
+    template <typename Visitor>
+    void
+    forEach(Visitor visit) const {
+      for (uint64_t i = written - size(); i < written; ++i) {
+        visit(events[i & (events.size() - 1)]);
+      }
+    }
+
+  private:
+    std::vector<TraceEvent> events;
+    uint64_t written = 0;
+  };
+
+  TraceLevel level;
+  std::size_t capacity;
+  uint64_t id;
+  Clock::time_point start;
+
+  mutable std::mutex buffersLock;
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  std::map<std::thread::id, Buffer*> threadBuffers;
+
+  // Tracers are told apart by a unique id rather than by address, since a new
+  // tracer may reuse the address of a destroyed one.
+  static inline std::atomic<uint64_t> nextId{1};
+  struct CachedBuffer {
+    uint64_t tracer;
+    Buffer* buffer;
+  };
+  static inline thread_local CachedBuffer cached{0, nullptr};
+
+  Buffer&
+  getBuffer() {
+    if (cached.tracer == id) {
+      return *cached.buffer;
+    }
+    std::lock_guard<std::mutex> guard{buffersLock};
+    auto& buffer = threadBuffers[std::this_thread::get_id()];
+    if (!buffer) {
+      buffers.push_back(std::make_unique<Buffer>(capacity));
+      buffer = buffers.back().get();
+    }
+    cached = {id, buffer};
+    return *buffer;
+  }
+
+  static TraceEvent
+  makeEvent(TraceLevel l, const char* name, const llvm::Value* subject,
+            llvm::ArrayRef<uint64_t> args, uint64_t timestamp,
+            uint64_t duration, bool isSpan) {
+    TraceEvent event{timestamp, duration, name, subject, {},
+                     static_cast<uint8_t>(std::min<std::size_t>(
+                       args.size(), TraceEvent::kMaxArgs)),
+                     l, isSpan};
+    std::copy_n(args.begin(), event.numArgs, event.args.begin());
+    return event;
+  }
+
+  template <typename T>
+  static void
+  write(llvm::raw_ostream& out, T value) {
+    for (unsigned byte = 0; byte < sizeof(T); ++byte) {
+      out << static_cast<char>((static_cast<uint64_t>(value) >> (8 * byte)) & 0xff);
+    }
+  }
+
+  static void
+  writeMicroseconds(llvm::raw_ostream& out, uint64_t nanoseconds) {
+    unsigned fraction = nanoseconds % 1000;
+    out << nanoseconds / 1000 << '.' << char('0' + fraction / 100)
+        << char('0' + fraction / 10 % 10) << char('0' + fraction % 10);
+  }
+
+  // Unnamed instructions, e.g. calls of void functions, are named after their
+  // function and source line.
+  static void
+  writeSubject(llvm::raw_ostream& out, const llvm::Value& subject) {
+    std::string text;
+    llvm::raw_string_ostream textOut{text};
+    auto* instruction = llvm::dyn_cast<llvm::Instruction>(&subject);
+    if (subject.hasName()) {
+      textOut << subject.getName();
+    } else if (instruction) {
+      textOut << instruction->getFunction()->getName();
+      if (auto& location = instruction->getDebugLoc()) {
+        textOut << ':' << location.getLine();
+      }
+    } else {
+      subject.printAsOperand(textOut, false);
+    }
+    for (char c : textOut.str()) {
+      if (c == '"' || c == '\\') {
+        out << '\\' << c;
+      } else if (static_cast<unsigned char>(c) >= 0x20) {
+        out << c;
+      }
+    }
+  }
+};
+
+
+// Records the time between its construction and its destruction as one
+// event. A null tracer or a disabled level makes it a no-op.
+class TraceSpan {
+public:
+  TraceSpan(Tracer* tracer, TraceLevel level, const char* name,
+            const llvm::Value* subject, uint64_t arg)
+    : tracer{tracer && tracer->isEnabled(level) ? tracer : nullptr},
+      level{level},
+      name{name},
+      subject{subject},
+      arg{arg},
+      begin{this->tracer ? this->tracer->now() : 0}
+      { }
+
+  ~TraceSpan() {
+    if (tracer) {
+      tracer->recordSpan(level, name, subject, begin, {arg});
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+  Tracer* tracer;
+  TraceLevel level;
+  const char* name;
+  const llvm::Value* subject;
+  uint64_t arg;
+  uint64_t begin;
+};
+
+
+} // end namespace
+
+
+#endif
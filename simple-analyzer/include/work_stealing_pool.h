@@ -0,0 +1,164 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace analysis {
+
+
+// A fixed size thread pool in which every worker owns a deque of tasks.
+// Tasks spawned from a worker are pushed onto that worker's own deque and
+// popped LIFO, which keeps the dependent work of a task on the same core.
+// Idle workers steal the oldest task from the other workers' deques.
+// Tasks submitted from outside the pool are distributed round robin.
+class WorkStealingPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit WorkStealingPool(unsigned numThreads)
+    : queues{},
+      workers{},
+      pending{0},
+      queued{0},
+      nextQueue{0},
+      stopping{false} {
+    numThreads = std::max(numThreads, 1u);
+    for (unsigned i = 0; i < numThreads; ++i) {
+      queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned i = 0; i < numThreads; ++i) {
+      workers.emplace_back([this, i] { runWorker(i); });
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> guard{sleepLock};
+      stopping = true;
+    }
+    wakeWorkers.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  unsigned size() const { return workers.size(); }
+
+  void
+  async(Task task) {
+    unsigned index = (currentPool == this)
+      ? currentWorker
+      : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+
+    pending.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> guard{queues[index]->lock};
+      queues[index]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> guard{sleepLock};
+      ++queued;
+    }
+    wakeWorkers.notify_one();
+  }
+
+  // Blocks until every submitted task, including the tasks those tasks
+  // spawned, has finished.
+  void
+  wait() {
+    std::unique_lock<std::mutex> guard{sleepLock};
+    allDone.wait(guard, [this] { return pending.load() == 0; });
+  }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<unsigned> pending;
+  unsigned queued;
+  std::atomic<unsigned> nextQueue;
+  bool stopping;
+
+  std::mutex sleepLock;
+  std::condition_variable wakeWorkers;
+  std::condition_variable allDone;
+
+  static inline thread_local WorkStealingPool* currentPool = nullptr;
+  static inline thread_local unsigned currentWorker = 0;
+
+  bool
+  takeTask(unsigned self, Task& task) {
+    {
+      auto& own = *queues[self];
+      std::lock_guard<std::mutex> guard{own.lock};
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (unsigned offset = 1; offset < queues.size(); ++offset) {
+      auto& victim = *queues[(self + offset) % queues.size()];
+      std::lock_guard<std::mutex> guard{victim.lock};
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void
+  runWorker(unsigned self) {
+    currentPool = this;
+    currentWorker = self;
+
+    while (true) {
+      {
+        std::unique_lock<std::mutex> guard{sleepLock};
+        wakeWorkers.wait(guard, [this] { return stopping || queued > 0; });
+        if (queued == 0) {
+          return;
+        }
+        --queued;
+      }
+
+      // Every decrement of `queued` is matched by exactly one task in some
+      // deque, but another worker may have taken it in the meantime, in
+      // which case the task it left behind is taken instead.
+      Task task;
+      while (!takeTask(self, task)) {
+        std::this_thread::yield();
+      }
+      task();
+
+      if (pending.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> guard{sleepLock};
+        allDone.notify_all();
+      }
+    }
+  }
+};
+
+
+} // end namespace
+
+
+#endif
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "dfa.h"
+#include "port_assignment.h"
+
+// An AffineAssignment describes the port counts at a program point
+// symbolically instead of enumerating them: every port's count is an affine
+// expression
+//
+//     port_i = base_i + k_0 * c_0i + k_1 * c_1i + ...
+//
+// over counters k_j that stand for how often a branch was taken or a loop
+// iterated. Meeting two assignments adds the difference of their bases as a
+// new counter direction, so the cost of the analysis grows with the number of
+// ports rather than with the number of paths. The counter directions are
+// kept as a basis in reduced row echelon form, so there are never more than
+// NumPorts - 1 of them and every ascending chain is finite.
+//
+// Like PortAssignments, the expressions are kept in normal form modulo an
+// equal number of elements on all ports: port 0 is always 0 and all other
+// expressions are relative to it.
+template <unsigned NumPorts>
+struct AffineAssignment {
+    using PortVector = std::array<int64_t, NumPorts>;
+    static constexpr unsigned kNumPorts = NumPorts;
+    static constexpr bool kSingleFact = true;
+
+    // Nothing is known about the ports before the first SB_CONFIG.
+    bool configured = false;
+    PortVector base{};
+    llvm::SmallVector<PortVector, 4> counters;
+
+    static AffineAssignment Configured() {
+        AffineAssignment a;
+        a.configured = true;
+        return a;
+    }
+
+    AffineAssignment operator+(const AffineAssignment& other) const {
+        if (!configured) {
+            return other;
+        }
+        if (!other.configured) {
+            return *this;
+        }
+
+        AffineAssignment joined = *this;
+        for (const PortVector& c : other.counters) {
+            joined.AddCounter(c);
+        }
+        joined.AddCounter(Difference(other.base, base));
+        return joined;
+    }
+
+    bool operator==(const AffineAssignment& other) const {
+        if (configured != other.configured) {
+            return false;
+        }
+        return counters == other.counters
+            && IsZero(Reduce(Difference(base, other.base)));
+    }
+
+    void AddAtPort(int portNum, int value) {
+        if (!configured) {
+            return;
+        }
+        base[portNum] += value;
+        Normalize(base);
+    }
+
+    // Adds `deltas`, one per port, any number of times, e.g. once for every
+    // iteration of a loop whose trip count is not known: a new counter.
+    void AddAnyMultiple(llvm::ArrayRef<int64_t> deltas) {
+        if (!configured) {
+            return;
+        }
+        PortVector direction;
+        std::copy(deltas.begin(), deltas.end(), direction.begin());
+        Normalize(direction);
+        AddCounter(direction);
+    }
+
+    // Adds a count that is not known to a port: any multiple of one element.
+    void AddUnknownAtPort(int portNum) {
+        PortVector unit{};
+        unit[portNum] = 1;
+        AddAnyMultiple(unit);
+    }
+
+    // Every port expression is identically equal to port 0.
+    bool isBalanced() const {
+        return !configured || (IsZero(base) && counters.empty());
+    }
+
+    // The number of counter directions, which bounds the cost of meeting and
+    // comparing assignments.
+    std::size_t Size() const {
+        return counters.size();
+    }
+
+    // Some valuation of the counters makes all ports equal, i.e. -base lies
+    // in the span of the counter directions.
+    bool hasBalanced() const {
+        return configured && IsZero(Reduce(base));
+    }
+
+    void encode(analysis::CacheWriter& out) const {
+        out.write(configured);
+        for (int64_t x : base) {
+            out.write(x);
+        }
+        out.write(counters.size());
+        for (const PortVector& row : counters) {
+            for (int64_t x : row) {
+                out.write(x);
+            }
+        }
+    }
+
+    static bool decode(analysis::CacheReader& in, AffineAssignment& a) {
+        int64_t configured, size;
+        if (!in.read(configured)) {
+            return false;
+        }
+        a.configured = configured;
+        for (int64_t& x : a.base) {
+            if (!in.read(x)) {
+                return false;
+            }
+        }
+        if (!in.read(size) || size < 0 || size >= (int64_t)NumPorts) {
+            return false;
+        }
+        a.counters.resize(size);
+        for (PortVector& row : a.counters) {
+            for (int64_t& x : row) {
+                if (!in.read(x)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    static bool IsZero(const PortVector& v) {
+        return std::all_of(v.begin(), v.end(), [] (int64_t x) { return x == 0; });
+    }
+
+    static void Normalize(PortVector& v) {
+        int64_t first = v[0];
+        for (int64_t& x : v) {
+            x -= first;
+        }
+    }
+
+    static PortVector Difference(const PortVector& a, const PortVector& b) {
+        PortVector d;
+        for (unsigned i = 0; i < NumPorts; i++) {
+            d[i] = a[i] - b[i];
+        }
+        return d;
+    }
+
+    static unsigned PivotOf(const PortVector& v) {
+        return std::find_if(v.begin(), v.end(),
+            [] (int64_t x) { return x != 0; }) - v.begin();
+    }
+
+    // Divides out the common factor of all entries and makes the pivot
+    // positive, which makes each basis row unique.
+    static void MakePrimitive(PortVector& v) {
+        int64_t g = 0;
+        for (int64_t x : v) {
+            g = std::gcd(g, std::abs(x));
+        }
+        if (g == 0) {
+            return;
+        }
+        if (v[PivotOf(v)] < 0) {
+            g = -g;
+        }
+        for (int64_t& x : v) {
+            x /= g;
+        }
+    }
+
+    // Eliminates the pivot columns of all counters from v. The result is
+    // zero iff v lies in the span of the counters.
+    PortVector Reduce(PortVector v) const {
+        for (const PortVector& row : counters) {
+            unsigned pivot = PivotOf(row);
+            if (v[pivot] == 0) {
+                continue;
+            }
+            int64_t scale = row[pivot];
+            int64_t factor = v[pivot];
+            for (unsigned i = 0; i < NumPorts; i++) {
+                v[i] = v[i] * scale - row[i] * factor;
+            }
+            MakePrimitive(v);
+        }
+        return v;
+    }
+
+    void AddCounter(const PortVector& direction) {
+        PortVector c = Reduce(direction);
+        if (IsZero(c)) {
+            return;
+        }
+        MakePrimitive(c);
+
+        // Keep the basis fully reduced: the new pivot column must be zero in
+        // all other rows.
+        unsigned pivot = PivotOf(c);
+        for (PortVector& row : counters) {
+            if (row[pivot] == 0) {
+                continue;
+            }
+            int64_t factor = row[pivot];
+            for (unsigned i = 0; i < NumPorts; i++) {
+                row[i] = row[i] * c[pivot] - c[i] * factor;
+            }
+            MakePrimitive(row);
+        }
+
+        auto position = std::find_if(counters.begin(), counters.end(),
+            [pivot] (const PortVector& row) { return PivotOf(row) > pivot; });
+        counters.insert(position, c);
+    }
+
+    template <unsigned N>
+    friend std::ostream& operator<<(std::ostream&, const AffineAssignment<N>&);
+};
+
+template <unsigned NumPorts>
+std::ostream& operator<<(std::ostream& os, const AffineAssignment<NumPorts>& a) {
+    if (!a.configured) {
+        return os;
+    }
+
+    os << '<';
+    for (unsigned i = 0; i < NumPorts; i++) {
+        if (i > 0) {
+            os << ", ";
+        }
+
+        bool empty = true;
+        if (a.base[i] != 0) {
+            os << a.base[i];
+            empty = false;
+        }
+        for (unsigned k = 0; k < a.counters.size(); k++) {
+            int64_t coefficient = a.counters[k][i];
+            if (coefficient == 0) {
+                continue;
+            }
+            if (!empty) {
+                os << (coefficient < 0 ? " - " : " + ");
+            } else if (coefficient < 0) {
+                os << '-';
+            }
+            if (std::abs(coefficient) != 1) {
+                os << std::abs(coefficient) << '*';
+            }
+            os << 'k' << k;
+            empty = false;
+        }
+        if (empty) {
+            os << 0;
+        }
+    }
+    os << ">\n";
+
+    return os;
+}
+
+template <unsigned NumPorts>
+class AffineAssignmentCombine
+    : public analysis::Meet<AffineAssignment<NumPorts>,
+                            AffineAssignmentCombine<NumPorts>> {
+public:
+    AffineAssignment<NumPorts>
+    meetPair(AffineAssignment<NumPorts>& a1,
+             AffineAssignment<NumPorts>& a2) const {
+        return a1 + a2;
+    }
+};
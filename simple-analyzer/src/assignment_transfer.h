@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Instruction.h"
+
+#include "dfa.h"
+#include "loop_summaries.h"
+#include "stream_intrinsics.h"
+#include "trace.h"
+
+// The transfer is shared by all port count domains. A domain Value provides
+// Configured() for the state after SB_CONFIG, AddAtPort() for every stream
+// command and AddUnknownAtPort() for those whose element count is not a
+// constant, Size() to measure it for the solver statistics, and kNumPorts, the
+// number of ports it tracks. The port counts are the only fact of the state,
+// so every domain is a single-fact domain. Every visited stream command is
+// recorded by `tracer` unless it is null, with the port and, if it is a
+// constant, the element count as arguments.
+//
+// With `loops`, the stream commands in summarized loops are no events, and the
+// summary of each such loop is added to the ports where it exits instead.
+// Summaries of loops with symbolic trip counts are only made for domains that
+// can add a delta any number of times with AddAnyMultiple().
+template <typename Value, typename = void>
+struct CanAddAnyMultiple : std::false_type { };
+
+template <typename Value>
+struct CanAddAnyMultiple<Value, std::void_t<
+    decltype(std::declval<Value&>().AddAnyMultiple(
+      std::declval<llvm::ArrayRef<int64_t>>()))>>
+  : std::true_type { };
+
+template <typename Value>
+class AssignmentSetExtend
+{
+    const softbrain::StreamIntrinsics* sb;
+    analysis::Tracer* tracer;
+    analysis::SolverStatistics* statistics;
+    const softbrain::LoopSummaries* loops;
+
+    static uint64_t ExtractConstant(llvm::CallSite cs, unsigned index) {
+        auto value = softbrain::getConstantArgument(cs, index);
+        assert(value && "arguments are checked before the analysis");
+        return *value;
+    }
+
+public:
+    AssignmentSetExtend(const softbrain::StreamIntrinsics& _sb,
+                        analysis::Tracer* _tracer,
+                        analysis::SolverStatistics* _statistics = nullptr,
+                        const softbrain::LoopSummaries* _loops = nullptr)
+        : sb(&_sb), tracer(_tracer), statistics(_statistics), loops(_loops) { }
+
+    // The SB_* intrinsics are modeled here. Calls of all other functions are
+    // analyzed interprocedurally by the DataflowAnalysis.
+    bool handlesCall(llvm::CallSite cs) const {
+        return sb->lookup(cs) != nullptr;
+    }
+
+    // Only the stream commands change the port counts, so everything else is
+    // left out of the graph that the analysis runs on.
+    bool isEvent(llvm::Instruction& i) const {
+        if (loops && loops->getExitEffect(i)) {
+            return true;
+        }
+        return handlesCall(llvm::CallSite(&i))
+            && !(loops && loops->isSummarized(i));
+    }
+
+    void operator()(llvm::Value &i, analysis::AbstractState<Value> &state) {
+        auto* inst = llvm::dyn_cast<llvm::Instruction>(&i);
+        if (loops && inst) {
+            if (auto* effect = loops->getExitEffect(*inst)) {
+                auto& deltas = effect->deltas;
+                for (unsigned port = 0; port < deltas.size(); port++) {
+                    if (deltas[port] != 0) {
+                        state[nullptr].AddAtPort(port, deltas[port]);
+                    }
+                }
+                if constexpr (CanAddAnyMultiple<Value>::value) {
+                    for (auto& multiple : effect->multiples) {
+                        state[nullptr].AddAnyMultiple(multiple);
+                    }
+                } else {
+                    assert(effect->multiples.empty()
+                        && "symbolic trip counts need AddAnyMultiple");
+                }
+            }
+            if (loops->isSummarized(*inst)) {
+                return;
+            }
+        }
+
+		llvm::CallSite cs(&i);
+        auto* intrinsic = sb->lookup(cs);
+        if (!intrinsic) return;
+
+        if (intrinsic->kind == softbrain::IntrinsicKind::Config) {
+			if (tracer) {
+				tracer->record(analysis::TraceLevel::Commands,
+					intrinsic->name, &i);
+			}
+
+			state[nullptr] = Value::Configured();
+        }
+        else if (intrinsic->hasPort()) {
+			// ports are numbered starting at 1
+			int port = ExtractConstant(cs, intrinsic->portArgument);
+			assert(port >= 1 && port <= (int)Value::kNumPorts
+				&& "ports are checked before the analysis");
+			auto nelems = softbrain::getElementCount(*intrinsic, cs);
+
+			if (tracer) {
+				if (nelems) {
+					tracer->record(analysis::TraceLevel::Commands,
+						intrinsic->name, &i, {uint64_t(port), *nelems});
+				} else {
+					tracer->record(analysis::TraceLevel::Commands,
+						intrinsic->name, &i, {uint64_t(port)});
+				}
+			}
+
+			if (nelems) {
+				state[nullptr].AddAtPort(port-1, *nelems);
+			} else {
+				state[nullptr].AddUnknownAtPort(port-1);
+			}
+        }
+
+        if (statistics) {
+            statistics->notePeakValueSize(state[nullptr].Size());
+        }
+    }
+};
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+
+#include "dfa.h"
+#include "port_assignment.h"
+
+// A DbmAssignment bounds the pairwise differences of the port counts with a
+// difference-bound matrix (DBM):
+//
+//     port_i - port_j <= bounds[i][j]
+//
+// Balance only depends on these differences, which is also why
+// PortAssignments are normalized, but a DBM describes all paths to a program
+// point at once instead of enumerating their assignments. Its size is
+// quadratic in the number of ports no matter how many paths there are, and
+// joining, comparing and widening DBMs are quadratic, too. The join is the
+// convex hull of the two, so like a PortHull it can prove that all or none of
+// the assignments are balanced, and is inconclusive otherwise.
+//
+// The bounds are kept closed, i.e. every bound is as tight as the others
+// imply, except after widening, which must not be followed by a closure to
+// guarantee termination. Queries close a copy first.
+template <unsigned NumPorts>
+struct DbmAssignment {
+    using Row = std::array<int64_t, NumPorts>;
+    static constexpr unsigned kNumPorts = NumPorts;
+    static constexpr bool kSingleFact = true;
+
+    // No bound. Finite bounds are smaller and far enough from the int64_t
+    // limits that the sum of two never overflows.
+    static constexpr int64_t kInf = std::numeric_limits<int64_t>::max() / 4;
+
+    // Nothing is known about the ports before the first SB_CONFIG.
+    bool configured = false;
+    std::array<Row, NumPorts> bounds{};
+
+    // After an SB_CONFIG all ports are empty, hence equal.
+    static DbmAssignment Configured() {
+        DbmAssignment a;
+        a.configured = true;
+        return a;
+    }
+
+    // The pointwise maximum of two closed DBMs is closed.
+    DbmAssignment operator+(const DbmAssignment& other) const {
+        if (!configured) {
+            return other;
+        }
+        if (!other.configured) {
+            return *this;
+        }
+
+        DbmAssignment joined = *this;
+        for (unsigned i = 0; i < NumPorts; i++) {
+            for (unsigned j = 0; j < NumPorts; j++) {
+                joined.bounds[i][j] =
+                    std::max(bounds[i][j], other.bounds[i][j]);
+            }
+        }
+        return joined;
+    }
+
+    bool operator==(const DbmAssignment& other) const {
+        return configured == other.configured
+            && (!configured || bounds == other.bounds);
+    }
+
+    // Adding to a port shifts its differences to all other ports, which
+    // keeps a closed DBM closed.
+    void AddAtPort(int portNum, int value) {
+        if (!configured) {
+            return;
+        }
+        for (unsigned j = 0; j < NumPorts; j++) {
+            if ((int)j == portNum) {
+                continue;
+            }
+            Shift(bounds[portNum][j], value);
+            Shift(bounds[j][portNum], -value);
+        }
+    }
+
+    // Nothing is known about the differences of a port after adding a count
+    // that is not known to it. Dropping its bounds keeps the DBM closed.
+    void AddUnknownAtPort(int portNum) {
+        if (!configured) {
+            return;
+        }
+        for (unsigned j = 0; j < NumPorts; j++) {
+            if ((int)j != portNum) {
+                bounds[portNum][j] = kInf;
+                bounds[j][portNum] = kInf;
+            }
+        }
+    }
+
+    // All ports are certainly equal.
+    bool isBalanced() const {
+        if (!configured) {
+            return true;
+        }
+        DbmAssignment closed = *this;
+        closed.Close();
+        for (const Row& row : closed.bounds) {
+            if (*std::max_element(row.begin(), row.end()) > 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Equal ports, i.e. all differences 0, satisfy all bounds. Closing
+    // first is not needed since closure preserves the set of solutions.
+    bool hasBalanced() const {
+        if (!configured) {
+            return false;
+        }
+        for (const Row& row : bounds) {
+            if (*std::min_element(row.begin(), row.end()) < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The number of finite bounds between distinct ports.
+    std::size_t Size() const {
+        std::size_t finite = 0;
+        for (const Row& row : bounds) {
+            finite += std::count_if(row.begin(), row.end(),
+                [] (int64_t bound) { return bound < kInf; });
+        }
+        return configured ? finite - NumPorts : 0;
+    }
+
+    // Bounds that grew since `older` are dropped. The result is not closed.
+    DbmAssignment Widen(const DbmAssignment& newer) const {
+        if (!configured || !newer.configured) {
+            return newer;
+        }
+        DbmAssignment widened = newer;
+        for (unsigned i = 0; i < NumPorts; i++) {
+            for (unsigned j = 0; j < NumPorts; j++) {
+                widened.bounds[i][j] = newer.bounds[i][j] <= bounds[i][j]
+                    ? bounds[i][j] : kInf;
+            }
+        }
+        return widened;
+    }
+
+    // Only the bounds that widening dropped are recovered from `newer`.
+    DbmAssignment Narrow(const DbmAssignment& newer) const {
+        if (!configured || !newer.configured) {
+            return *this;
+        }
+        DbmAssignment narrowed = *this;
+        for (unsigned i = 0; i < NumPorts; i++) {
+            for (unsigned j = 0; j < NumPorts; j++) {
+                if (bounds[i][j] == kInf) {
+                    narrowed.bounds[i][j] = newer.bounds[i][j];
+                }
+            }
+        }
+        narrowed.Close();
+        return narrowed;
+    }
+
+    // Floyd-Warshall over the bounds. The loops have compile-time trip counts
+    // and the inner one is a branch-free select and min over a row, which
+    // compilers vectorize on targets with 64-bit integer min, e.g. AVX-512.
+    // Finite bounds stay below kInf, since a sum of two that reaches it loses
+    // against the bound it would replace.
+    void Close() {
+        for (unsigned k = 0; k < NumPorts; k++) {
+            const Row through = bounds[k];
+            for (unsigned i = 0; i < NumPorts; i++) {
+                const int64_t to = bounds[i][k];
+                if (to == kInf) {
+                    continue;
+                }
+                Row& row = bounds[i];
+                for (unsigned j = 0; j < NumPorts; j++) {
+                    int64_t via = through[j] == kInf ? kInf : to + through[j];
+                    row[j] = std::min(row[j], via);
+                }
+            }
+        }
+    }
+
+    void encode(analysis::CacheWriter& out) const {
+        out.write(configured);
+        for (const Row& row : bounds) {
+            for (int64_t bound : row) {
+                out.write(bound);
+            }
+        }
+    }
+
+    static bool decode(analysis::CacheReader& in, DbmAssignment& a) {
+        int64_t configured;
+        if (!in.read(configured)) {
+            return false;
+        }
+        a.configured = configured;
+        for (Row& row : a.bounds) {
+            for (int64_t& bound : row) {
+                if (!in.read(bound) || bound > kInf || bound < -kInf) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    static void Shift(int64_t& bound, int64_t value) {
+        if (bound < kInf) {
+            bound = std::min(bound + value, kInf);
+        }
+    }
+};
+
+template <unsigned NumPorts>
+std::ostream& operator<<(std::ostream& os, const DbmAssignment<NumPorts>& a) {
+    if (!a.configured) {
+        return os;
+    }
+
+    constexpr int64_t kInf = DbmAssignment<NumPorts>::kInf;
+    os << '<';
+    for (unsigned i = 0; i < NumPorts; i++) {
+        for (unsigned j = i + 1; j < NumPorts; j++) {
+            if (i > 0 || j > 1) {
+                os << ", ";
+            }
+            os << i << '-' << j << ": ";
+            int64_t lower = a.bounds[j][i];
+            int64_t upper = a.bounds[i][j];
+            if (lower < kInf) {
+                os << -lower;
+            } else {
+                os << "-inf";
+            }
+            os << "..";
+            if (upper < kInf) {
+                os << upper;
+            } else {
+                os << "inf";
+            }
+        }
+    }
+    os << ">\n";
+
+    return os;
+}
+
+template <unsigned NumPorts>
+class DbmAssignmentCombine
+    : public analysis::Meet<DbmAssignment<NumPorts>,
+                            DbmAssignmentCombine<NumPorts>> {
+public:
+    DbmAssignment<NumPorts>
+    meetPair(DbmAssignment<NumPorts>& a1, DbmAssignment<NumPorts>& a2) const {
+        return a1 + a2;
+    }
+};
+
+// Differences can grow without bound around a loop that streams an
+// unbalanced number of elements per iteration, so DBMs need widening.
+template <unsigned NumPorts>
+class DbmAssignmentWiden
+    : public analysis::Widening<DbmAssignment<NumPorts>,
+                                DbmAssignmentWiden<NumPorts>> {
+public:
+    using analysis::Widening<DbmAssignment<NumPorts>,
+                             DbmAssignmentWiden<NumPorts>>::Widening;
+
+    DbmAssignment<NumPorts>
+    widenPair(const DbmAssignment<NumPorts>& older,
+              const DbmAssignment<NumPorts>& newer) const {
+        return older.Widen(newer);
+    }
+
+    DbmAssignment<NumPorts>
+    narrowPair(const DbmAssignment<NumPorts>& older,
+               const DbmAssignment<NumPorts>& newer) const {
+        return older.Narrow(newer);
+    }
+};
@@ -1,32 +1,58 @@
-
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <memory>
-#include <unordered_set>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "llvm/ADT/APSInt.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "affine_assignment.h"
+#include "assignment_transfer.h"
+#include "dbm_assignment.h"
 #include "dfa.h"
+#include "kernel_module.h"
+#include "loop_summaries.h"
+#include "port_assignment.h"
+#include "result_cache.h"
+#include "stream_intrinsics.h"
+#include "work_stealing_pool.h"
 
 using namespace llvm;
+using softbrain::StreamIntrinsics;
 
 static cl::OptionCategory balance_cat{"balance analyzer options"};
 
 static cl::opt<std::string> input_path {
     cl::Positional,
-    cl::desc{"<Module to analyze>"},
+    cl::desc{"<Module to analyze, or a module list / directory with --batch>"},
     cl::value_desc{"bitcode filename"},
     cl::init(""),
     cl::Required,
@@ -40,328 +66,904 @@ static cl::opt<int> num_ports {
     cl::Required,
     cl::cat{balance_cat}};
 
-static llvm::Function * SB_CONFIG;
-static llvm::Function * SB_WAIT;
-static llvm::Function * SB_MEM_PORT_STREAM;
-static llvm::Function * SB_CONSTANT;
-static llvm::Function * SB_PORT_MEM_STREAM;
-static llvm::Function * SB_DISCARD;
+enum class Domain { Sets, Affine, Dbm };
 
-struct PortAssignment {
-    std::vector<int> port_values;
+static cl::opt<Domain> domain {
+    "domain",
+    cl::desc{"Abstract domain used to track the port counts"},
+    cl::values(
+        clEnumValN(Domain::Sets, "sets",
+            "Enumerate the set of reachable port assignments"),
+        clEnumValN(Domain::Affine, "affine",
+            "Affine expressions over branch and loop counters"),
+        clEnumValN(Domain::Dbm, "dbm",
+            "Bounds on the differences between port counts")),
+    cl::init(Domain::Sets),
+    cl::cat{balance_cat}};
 
-    // Invariant: PortAssignments are always guaranteed to be in "normal form"
-    // (I.e. at least one value is 0).
+static const char *
+domainName(Domain d) {
+    switch (d) {
+    case Domain::Sets:   return "sets";
+    case Domain::Affine: return "affine";
+    case Domain::Dbm:    return "dbm";
+    }
+    llvm_unreachable("unknown domain");
+}
 
-    PortAssignment(const std::vector<int>& _port_values)
-        : port_values(_port_values) {
+static cl::opt<unsigned> max_assignments {
+    "max-assignments",
+    cl::desc{"Most assignments a set enumerates before it is "
+             "summarized by per-port bounds (0 for no limit; sets only)"},
+    cl::init(0),
+    cl::cat{balance_cat}};
 
-        int min = *std::min_element(port_values.begin(), port_values.end());
-        for (int& i : port_values) {
-            i -= min;
-        }
-    }
+static cl::opt<unsigned> widening_delay {
+    "widening-delay",
+    cl::desc{"Number of visits to a loop head before its state is widened"},
+    cl::init(3),
+    cl::cat{balance_cat}};
 
-    bool operator==(const PortAssignment& other) const {
-        int i;
+static cl::opt<unsigned> narrowing_passes {
+    "narrowing-passes",
+    cl::desc{"Number of descending passes run after widening"},
+    cl::init(1),
+    cl::cat{balance_cat}};
 
-        if (port_values.size() != other.port_values.size()) {
-            return false;
-        }
+static cl::opt<bool> summarize_loops {
+    "summarize-loops",
+    cl::desc{"Apply the effect of loops with a known per-iteration delta and "
+             "trip count at their exit instead of iterating them"},
+    cl::init(true),
+    cl::cat{balance_cat}};
 
-        for (i = 0; i < port_values.size(); i++) {
-            if (port_values[i] != other.port_values[i]) {
-                return false;
-            }
-        }
+static cl::list<std::string> entry_names {
+    "entry",
+    cl::desc{"Function to analyze as an entry point (default: main)"},
+    cl::value_desc{"function"},
+    cl::ZeroOrMore,
+    cl::cat{balance_cat}};
 
-        return true;
-    }
+static cl::opt<unsigned> num_threads {
+    "solver-threads",
+    cl::desc{"Number of threads used to solve (context, function) pairs"},
+    cl::init(1),
+    cl::cat{balance_cat}};
 
-    std::size_t hash() const {
-        int sum = 0;
+static cl::opt<unsigned> context_depth {
+    "context-depth",
+    cl::desc{"Length of the call strings that distinguish calling contexts "
+             "(0 = context insensitive)"},
+    cl::init(2),
+    cl::cat{balance_cat}};
 
-        for (int i : port_values) {
-            sum += i;
-        }
+static cl::opt<analysis::RetentionPolicy::Kind> retain_states {
+    "retain-states",
+    cl::desc{"States kept once a function is solved; others are recomputed "
+             "from their block when needed"},
+    cl::values(
+        clEnumValN(analysis::RetentionPolicy::All, "all",
+            "The state after every stream command and call"),
+        clEnumValN(analysis::RetentionPolicy::BlockBoundaries, "blocks",
+            "Only the states at block entries and exits"),
+        clEnumValN(analysis::RetentionPolicy::Matching, "waits",
+            "The block states and the states at SB_WAIT")),
+    cl::init(analysis::RetentionPolicy::Matching),
+    cl::cat{balance_cat}};
 
-        return sum;
-    }
+static cl::opt<analysis::TraceLevel> trace_level {
+    "trace-level",
+    cl::desc{"Events recorded into the trace (single module mode only)"},
+    cl::values(
+        clEnumValN(analysis::TraceLevel::Off, "off", "Record nothing"),
+        clEnumValN(analysis::TraceLevel::Commands, "commands",
+            "Every interpreted stream command"),
+        clEnumValN(analysis::TraceLevel::Solver, "solver",
+            "Stream commands and every solved (context, function) pair"),
+        clEnumValN(analysis::TraceLevel::Blocks, "blocks",
+            "Everything above and every visited block")),
+    cl::init(analysis::TraceLevel::Off),
+    cl::cat{balance_cat}};
 
-    bool Balanced() const {
-        // Only need to check against 0 since the only normal form balanced
-        // assignment is <0, 0, ...>
-        for (int i : port_values) {
-            if (i != 0) {
-                return false;
-            }
-        }
+enum class TraceFormat { Chrome, Binary };
 
-        return true;
+static cl::opt<TraceFormat> trace_format {
+    "trace-format",
+    cl::desc{"Format of the trace file"},
+    cl::values(
+        clEnumValN(TraceFormat::Chrome, "chrome", "Chrome trace-event JSON"),
+        clEnumValN(TraceFormat::Binary, "binary", "Compact binary records")),
+    cl::init(TraceFormat::Chrome),
+    cl::cat{balance_cat}};
+
+static cl::opt<std::string> trace_output {
+    "trace-output",
+    cl::desc{"File the trace is written to (default: trace.json or trace.bin)"},
+    cl::value_desc{"filename"},
+    cl::init(""),
+    cl::cat{balance_cat}};
+
+static cl::opt<unsigned> trace_buffer {
+    "trace-buffer",
+    cl::desc{"Number of trace events kept per thread; older ones are dropped"},
+    cl::init(1 << 16),
+    cl::cat{balance_cat}};
+
+// Statistics are enabled by LLVM's own -stats option, which this tool must not
+// register a second time.
+static cl::opt<std::string> stats_output {
+    "stats-output",
+    cl::desc{"With -stats, write the statistics as JSON to this file instead "
+             "of printing them (single module mode only)"},
+    cl::value_desc{"filename"},
+    cl::init(""),
+    cl::cat{balance_cat}};
+
+static cl::opt<std::string> cache_dir {
+    "cache-dir",
+    cl::desc{"Directory in which results are cached across runs; only the "
+             "functions whose results may have changed are solved again"},
+    cl::value_desc{"directory"},
+    cl::init(""),
+    cl::cat{balance_cat}};
+
+static cl::opt<bool> server_mode {
+    "server",
+    cl::desc{"Load the input module and then answer JSON-RPC requests read "
+             "from stdin, one per line"},
+    cl::init(false),
+    cl::cat{balance_cat}};
+
+static cl::opt<unsigned> server_cache_size {
+    "server-cache-size",
+    cl::desc{"Megabytes of results the server keeps in memory per module "
+             "when no cache directory is given"},
+    cl::init(64),
+    cl::cat{balance_cat}};
+
+static cl::opt<bool> batch_mode {
+    "batch",
+    cl::desc{"Treat the input as a directory of modules or a file that lists "
+             "one module path per line"},
+    cl::init(false),
+    cl::cat{balance_cat}};
+
+static cl::opt<unsigned> num_jobs {
+    "jobs",
+    cl::desc{"Number of modules parsed and analyzed concurrently in batch mode"},
+    cl::init(std::max(1u, std::thread::hardware_concurrency())),
+    cl::cat{balance_cat}};
+
+enum class Verdict { Balanced, MaybeBalanced, NotBalanced };
+
+static const char *
+verdictName(Verdict verdict) {
+    switch (verdict) {
+    case Verdict::Balanced:      return "Balanced";
+    case Verdict::MaybeBalanced: return "Maybe balanced";
+    case Verdict::NotBalanced:   return "Not balanced";
     }
-	
-	const PortAssignment AddAtPort(int portNum, int value) {		
-		std::vector<int> copy = port_values;
-		copy[portNum] += value; 
-				
-		return PortAssignment(copy);
-	}
-	
-	bool isBalanced() {
-		return (*std::max_element(port_values.begin(), port_values.end()) == 0);
-	}
+    llvm_unreachable("unknown verdict");
+}
+
+// The verdict for one SB_WAIT in one calling context.
+struct WaitResult {
+    const llvm::Instruction * wait;
+    Verdict verdict;
 };
 
-std::ostream& operator<<(std::ostream& os, const PortAssignment& p) {
-	os << '<';
-	
-	int c = 0;
-	for (auto i = p.port_values.begin(); i != p.port_values.end(); i++) {
-		
-		if (c > 0) {
-			os << ", ";
+// The phase timers and counters reported with -stats.
+struct Statistics {
+    llvm::TimerGroup group{"balance-analyzer", "Balance analyzer phases"};
+    llvm::Timer parse{"parse", "Parse IR", group};
+    llvm::Timer solve{"solve", "Compute dataflow", group};
+    // Collecting the verdicts, which may recompute states, and printing them.
+    llvm::Timer print{"print", "Collect and print wait balance", group};
+    analysis::SolverStatistics solver;
+    // (context, function) pairs with results.
+    uint64_t contexts = 0;
+    // Outermost loops replaced by their summaries.
+    uint64_t loops = 0;
+};
+
+// All state of the analysis of one module. Nothing in here is shared with
+// other modules, so the batch driver can run one ModuleAnalysis per thread.
+struct ModuleAnalysis {
+    llvm::Module& module;
+    StreamIntrinsics sb;
+    unsigned num_ports;
+    analysis::Tracer * tracer;
+    Statistics * statistics;
+    analysis::ResultCache * cache;
+    std::vector<WaitResult> waits;
+
+    ModuleAnalysis(llvm::Module& _module, unsigned _num_ports,
+                   analysis::Tracer * _tracer,
+                   Statistics * _statistics = nullptr,
+                   analysis::ResultCache * _cache = nullptr)
+        : module(_module), sb(_module), num_ports(_num_ports), tracer(_tracer),
+          statistics(_statistics), cache(_cache) { }
+};
+
+template <typename Analysis>
+static void
+collectWaits(ModuleAnalysis& ma, Analysis& analysis, llvm::Function& function,
+             typename Analysis::FunctionResults& functionResults) {
+	for (auto& i : llvm::instructions(function)) {
+		auto* inst = &i;
+		auto* intrinsic = ma.sb.lookup(llvm::CallSite{inst});
+
+		if (!intrinsic || intrinsic->kind != softbrain::IntrinsicKind::Wait) {
+			continue;
+		}
+
+		auto localState = analysis.getState(functionResults, *inst);
+		if (!localState) {
+			continue;
+		}
+
+		if ((*localState)[nullptr].isBalanced()) {
+			ma.waits.push_back({inst, Verdict::Balanced});
+		}
+		else if ((*localState)[nullptr].hasBalanced()) {
+			ma.waits.push_back({inst, Verdict::MaybeBalanced});
+		}
+		else {
+			ma.waits.push_back({inst, Verdict::NotBalanced});
 		}
-		os << (*i);
-		c++;
 	}
-	os << '>';
-	
-	return os;
 }
 
-namespace std {
+static void
+printWaitBalance(const ModuleAnalysis& ma) {
+	for (auto& result : ma.waits) {
+		llvm::outs() << "SB_WAIT" << '\n';
+		switch (result.verdict) {
+		case Verdict::Balanced:
+			llvm::outs().changeColor(raw_ostream::Colors::GREEN);
+			break;
+		case Verdict::MaybeBalanced:
+			llvm::outs().changeColor(raw_ostream::Colors::YELLOW);
+			break;
+		case Verdict::NotBalanced:
+			llvm::outs().changeColor(raw_ostream::Colors::RED);
+			break;
+		}
+		std::cout << verdictName(result.verdict) << "\n\n";
+	}
+}
 
-    template <>
-    struct hash<PortAssignment> {
-        std::size_t operator()(const PortAssignment& k) const {
-            using std::size_t;
-            using std::hash;
-            return k.hash();
-        }
+template <typename Value, typename Meet, typename Widen>
+static void
+runAnalysis(ModuleAnalysis& ma, llvm::ArrayRef<llvm::Function*> entry_points,
+            Meet meet, Widen widen) {
+    using Transfer = AssignmentSetExtend<Value>;
+    using Analysis = analysis::DataflowAnalysis<Value, Transfer, Meet,
+                                                analysis::Forward, Widen>;
+    analysis::SolverOptions options;
+    options.numThreads = num_threads;
+    options.contextDepth = context_depth;
+    options.tracer = ma.tracer;
+    options.cache = ma.cache;
+    options.retention.kind = retain_states;
+    options.retention.matches = [&ma] (llvm::Instruction& i) {
+        auto* intrinsic = ma.sb.lookup(llvm::CallSite{&i});
+        return intrinsic && intrinsic->kind == softbrain::IntrinsicKind::Wait;
     };
+    if (ma.statistics) {
+        options.statistics = &ma.statistics->solver;
+    }
+
+    std::optional<softbrain::LoopSummaries> loops;
+    if (summarize_loops) {
+        llvm::TimeRegion timing{ma.statistics ? &ma.statistics->solve : nullptr};
+        loops.emplace(ma.module, ma.sb, ma.num_ports,
+                      CanAddAnyMultiple<Value>::value);
+        if (ma.statistics) {
+            ma.statistics->loops += loops->size();
+        }
+    }
 
+    Analysis analysis{ma.module, entry_points,
+                      Transfer{ma.sb, ma.tracer, options.statistics,
+                               loops ? &*loops : nullptr},
+                      std::move(meet), std::move(widen), options};
+    {
+        llvm::TimeRegion timing{ma.statistics ? &ma.statistics->solve : nullptr};
+        analysis.computeDataflow();
+    }
+
+    llvm::TimeRegion timing{ma.statistics ? &ma.statistics->print : nullptr};
+    analysis.forEachResult(
+        [&ma, &analysis] (auto /*callString*/, llvm::Function& function,
+                          auto& functionResults) {
+            if (ma.statistics) {
+                ++ma.statistics->contexts;
+            }
+            collectWaits(ma, analysis, function, functionResults);
+        });
 }
 
-struct AssignmentSet {
-    std::unordered_set<PortAssignment> assignments;
+template <unsigned NumPorts>
+static void
+analyzeModule(ModuleAnalysis& ma, llvm::ArrayRef<llvm::Function*> entry_points) {
+    switch (domain) {
+    case Domain::Sets: {
+        // The assignments interned by the analysis are released after it.
+        typename PortAssignmentTable<NumPorts>::Use table;
+        runAnalysis<AssignmentSet<NumPorts>>(
+            ma, entry_points,
+            AssignmentSetCombine<NumPorts>{max_assignments},
+            AssignmentSetWiden<NumPorts>{widening_delay, narrowing_passes});
+        break;
+    }
+    case Domain::Affine:
+        // Affine assignments have finite ascending chains and need no widening.
+        runAnalysis<AffineAssignment<NumPorts>>(
+            ma, entry_points,
+            AffineAssignmentCombine<NumPorts>{},
+            analysis::NoWidening<AffineAssignment<NumPorts>>{});
+        break;
+    case Domain::Dbm:
+        runAnalysis<DbmAssignment<NumPorts>>(
+            ma, entry_points,
+            DbmAssignmentCombine<NumPorts>{},
+            DbmAssignmentWiden<NumPorts>{widening_delay, narrowing_passes});
+        break;
+    }
+}
 
-    AssignmentSet() { }
+// One instantiation of the analysis per supported port count; analyze()
+// picks the right one for the port count of the ModuleAnalysis.
+template <std::size_t... Indices>
+static constexpr auto
+makePortCountTable(std::index_sequence<Indices...>) {
+    using Analyze = void (*)(ModuleAnalysis&, llvm::ArrayRef<llvm::Function*>);
+    return std::array<Analyze, sizeof...(Indices)>{
+        &analyzeModule<Indices + 1>...};
+}
 
-    AssignmentSet(std::unordered_set<PortAssignment>&& _assignments)
-        : assignments(_assignments) { }
+static constexpr auto analyzePortCount =
+    makePortCountTable(std::make_index_sequence<kMaxPorts>{});
 
-    AssignmentSet operator+(const AssignmentSet& other) const {
-        std::unordered_set<PortAssignment> new_assignments = this->assignments;
+static void
+analyze(ModuleAnalysis& ma, llvm::ArrayRef<llvm::Function*> entry_points) {
+    analyzePortCount[ma.num_ports - 1](ma, entry_points);
+}
 
-        new_assignments.insert(
-            other.assignments.begin(),
-            other.assignments.end());
+static llvm::Expected<std::vector<llvm::Function*>>
+findEntryPoints(llvm::Module& module) {
+    std::vector<llvm::Function*> entry_points;
+    for (auto& name : entry_names) {
+        auto * entry_func = module.getFunction(name);
 
-        return AssignmentSet(std::move(new_assignments));
+        if (!entry_func) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                "Unable to find %s function.", name.c_str());
+        }
+        entry_points.push_back(entry_func);
     }
+    return entry_points;
+}
 
-    bool operator==(const AssignmentSet& other) const {
-        return false;
+// Every stream command must use one of the `num_ports` ports that are
+// analyzed, and its port must be a constant. Its element count need not be.
+static llvm::Error
+checkPorts(llvm::Module& module) {
+    StreamIntrinsics sb{module};
+    for (auto& f : module) {
+        for (auto& i : llvm::instructions(f)) {
+            llvm::CallSite cs(&i);
+            auto* intrinsic = sb.lookup(cs);
+            if (!intrinsic || !intrinsic->hasPort()) {
+                continue;
+            }
+            auto port = softbrain::getConstantArgument(cs,
+                intrinsic->portArgument);
+            if (!port) {
+                return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                    "%s in %s has a port that is not a constant.",
+                    intrinsic->name, f.getName().str().c_str());
+            }
+            if (*port < 1 || *port > (uint64_t)num_ports) {
+                return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                    "%s in %s streams through port %llu, but only %d ports "
+                    "are analyzed.", intrinsic->name, f.getName().str().c_str(),
+                    (unsigned long long)*port, (int)num_ports);
+            }
+        }
     }
+    return llvm::Error::success();
+}
 
-    bool AlwaysBalanced() const {
-        return assignments.size() == 1 && assignments.begin()->Balanced();
+// A batch input is either a directory, of which every .ll and .bc file is
+// analyzed, or a text file with one module path per line.
+static std::vector<std::string>
+collectBatchInputs(llvm::StringRef path) {
+    std::vector<std::string> inputs;
+
+    if (llvm::sys::fs::is_directory(path)) {
+        std::error_code ec;
+        for (llvm::sys::fs::directory_iterator it{path, ec}, end;
+             it != end && !ec; it.increment(ec)) {
+            llvm::StringRef extension = llvm::sys::path::extension(it->path());
+            if (extension == ".ll" || extension == ".bc") {
+                inputs.push_back(it->path());
+            }
+        }
+        std::sort(inputs.begin(), inputs.end());
+        return inputs;
     }
-	
-	void AddAtPort(int portNum, int value) {
-		std::unordered_set<PortAssignment> updated;
-		for (auto i : assignments) {
-			PortAssignment p = i.AddAtPort(portNum, value);
-			updated.insert(p);
-		}
-		assignments = updated;
-	}
-	
-	bool isBalanced() {
-		for (auto a : assignments) {
-			if (!a.isBalanced()) {
-				return false;
-			}
-		}
-		return true;
-	}
-	
-	bool hasBalanced() {
-		for (auto a : assignments) {
-			if (a.isBalanced()) {
-				return true;
-			}
-		}
-		return false;		
-	}
-};
 
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        llvm::report_fatal_error(llvm::Twine{"Unable to read batch list "}
+            + path + ": " + buffer.getError().message());
+    }
 
-std::ostream& operator<<(std::ostream& os, const AssignmentSet& a) {	
-	for (auto i = a.assignments.begin(); i != a.assignments.end(); i++) {
-		os << (*i) << '\n';
-	}
-	
-	return os;
+    llvm::SmallVector<llvm::StringRef, 16> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+    for (llvm::StringRef line : lines) {
+        line = line.trim();
+        if (!line.empty() && !line.startswith("#")) {
+            inputs.push_back(line.str());
+        }
+    }
+    return inputs;
 }
 
+// Analyzes every module of the batch in its own LLVMContext on a pool of
+// num_jobs threads, so that parsing one module overlaps with the analysis of
+// the others. Records are printed in input order once all modules are done:
+//
+//     module,function,line,verdict
+//
+// with one record per SB_WAIT and calling context.
+static int
+runBatch(const char * argv0, analysis::ResultCache * cache) {
+    std::vector<std::string> inputs = collectBatchInputs(input_path);
+    std::vector<std::string> records(inputs.size());
+    std::vector<std::string> errors(inputs.size());
 
-using AssignmentSetState = analysis::AbstractState<AssignmentSet>;
-using AssignmentSetResult = analysis::DataflowResult<AssignmentSet>;
+    {
+        analysis::WorkStealingPool pool{num_jobs};
+        for (std::size_t index = 0; index < inputs.size(); ++index) {
+            pool.async([&inputs, &records, &errors, argv0, cache, index] {
+                auto& path = inputs[index];
+                llvm::raw_string_ostream out{records[index]};
+                llvm::raw_string_ostream err_out{errors[index]};
 
-class AssignmentSetCombine : public analysis::Meet<AssignmentSet, AssignmentSetCombine> {
-public:
-    AssignmentSet meetPair(AssignmentSet &s1, AssignmentSet &s2) const {
-        return s1 + s2;
+                SMDiagnostic err;
+                LLVMContext context;
+                std::unique_ptr<Module> module =
+                    softbrain::loadKernelModule(path, entry_names, err, context);
+
+                if (!module) {
+                    err_out << "Error reading bitcode file: " << path << "\n";
+                    err.print(argv0, err_out);
+                    return;
+                }
+
+                auto entry_points = findEntryPoints(*module);
+                if (!entry_points) {
+                    err_out << path << ": "
+                        << llvm::toString(entry_points.takeError()) << "\n";
+                    return;
+                }
+                if (auto error = checkPorts(*module)) {
+                    err_out << path << ": "
+                        << llvm::toString(std::move(error)) << "\n";
+                    return;
+                }
+
+                ModuleAnalysis ma{*module, (unsigned)num_ports, nullptr,
+                                  nullptr, cache};
+                analyze(ma, *entry_points);
+
+                for (auto& result : ma.waits) {
+                    unsigned line = 0;
+                    if (auto& location = result.wait->getDebugLoc()) {
+                        line = location.getLine();
+                    }
+                    out << path << ','
+                        << result.wait->getFunction()->getName() << ','
+                        << line << ','
+                        << verdictName(result.verdict) << '\n';
+                }
+            });
+        }
+        pool.wait();
+    }
+
+    int status = 0;
+    llvm::outs() << "module,function,line,verdict\n";
+    for (std::size_t index = 0; index < inputs.size(); ++index) {
+        llvm::outs() << records[index];
+        if (!errors[index].empty()) {
+            errs() << errors[index];
+            status = -1;
+        }
     }
+    return status;
+}
+
+// A module held by the server between requests. The results are answered
+// from memory until the contents of the file change. Every version of the
+// module is parsed into a fresh context, so that the types, constants and
+// metadata of earlier versions are freed and named struct types keep their
+// names, on which the cache keys depend.
+struct ServedModule {
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::unique_ptr<llvm::Module> module;
+    std::unique_ptr<ModuleAnalysis> analysis;
+    llvm::MD5::MD5Result digest;
 };
 
-class AssignmentSetExtend
-{
-    llvm::Function* getCalledFunction(llvm::CallSite cs) {
-        auto* calledValue = cs.getCalledValue()->stripPointerCasts();
-        return llvm::dyn_cast<llvm::Function>(calledValue);
+// Answers JSON-RPC 2.0 requests, one per line on stdin, with one response
+// per line on stdout:
+//
+//     load     {"module": path}
+//              analyzes the module again if its file changed and returns
+//              {"module", "changed", "waits", "solved", "reused"}
+//     waits    {"module": path, "function": name (optional)}
+//              returns [{"function", "line", "verdict"}, ...], one per
+//              SB_WAIT and calling context, loading the module if needed
+//     unload   {"module": path}
+//     shutdown
+//
+// Results are cached, so after an edit only the functions whose results may
+// have changed are solved again: in `directory` if one is given, and
+// otherwise in memory, per module until it is unloaded.
+class Server {
+public:
+    Server(analysis::ResultCache* directory, std::string salt)
+        : directory(directory), salt(std::move(salt)) { }
+
+    // Loads a module before the first request. Errors are only reported,
+    // since the module may be fixed and loaded again.
+    void
+    preload(llvm::StringRef path) {
+        if (auto result = load(path); !result) {
+            errs() << path << ": " << llvm::toString(result.takeError()) << "\n";
+        }
     }
 
-    const llvm::APInt ExtractConstant(const llvm::Value * val) {
-        if (auto* constant = llvm::dyn_cast<llvm::ConstantInt>(val)) {
-            return constant->getValue();
+    int
+    run() {
+        std::string line;
+        while (!done && std::getline(std::cin, line)) {
+            if (llvm::StringRef{line}.trim().empty()) {
+                continue;
+            }
+            if (auto response = handle(line)) {
+                llvm::outs() << *response << '\n';
+                llvm::outs().flush();
+            }
         }
-        assert(false);
+        return 0;
     }
 
-public:
-    void operator()(llvm::Value &i, AssignmentSetState &state) {
-		llvm::CallSite cs(&i);
-        if (!cs.getInstruction()) return;
-
-        llvm::Function * func = getCalledFunction(cs);
-        if (func->isDeclaration()) return;
-
-        if (func == SB_CONFIG) {			
-			std::cout << "SB_CONFIG("
-                << ")" << std::endl;
-				
-			PortAssignment bottom(std::vector<int> (num_ports,0));
-			
-			std::unordered_set<PortAssignment> pas;
-			pas.insert(bottom);
-			
-			AssignmentSet as;
-			as.assignments = pas;
-			
-			state[&i] = as;
-			
-			std::cout << state[&i] << '\n';
-			
-			state[nullptr] = as;
+private:
+    enum ErrorCode {
+        ParseError = -32700,
+        InvalidRequest = -32600,
+        MethodNotFound = -32601,
+        InvalidParams = -32602,
+        AnalysisFailed = -32000,
+    };
+
+    analysis::ResultCache* directory;
+    std::string salt;
+    llvm::StringMap<std::unique_ptr<ServedModule>> modules;
+    // The in-memory caches of the modules, which outlive failed loads.
+    llvm::StringMap<std::unique_ptr<analysis::ResultCache>> caches;
+    bool done = false;
+
+    static llvm::json::Value
+    makeError(llvm::json::Value id, int code, std::string message) {
+        return llvm::json::Object{
+            {"jsonrpc", "2.0"},
+            {"id", std::move(id)},
+            {"error", llvm::json::Object{{"code", code},
+                                         {"message", std::move(message)}}}};
+    }
+
+    // Returns the response, or nothing for notifications.
+    llvm::Optional<llvm::json::Value>
+    handle(llvm::StringRef line) {
+        auto parsed = llvm::json::parse(line);
+        if (!parsed) {
+            return makeError(nullptr, ParseError,
+                             llvm::toString(parsed.takeError()));
+        }
+        auto* request = parsed->getAsObject();
+        auto method = request ? request->getString("method") : llvm::None;
+        if (!method) {
+            return makeError(nullptr, InvalidRequest, "Not a request.");
+        }
+        llvm::json::Value id = nullptr;
+        bool notification = true;
+        if (auto* found = request->get("id")) {
+            id = *found;
+            notification = false;
+        }
+        llvm::json::Object noParams;
+        auto* params = request->getObject("params");
+        if (!params) {
+            params = &noParams;
+        }
+
+        int code = AnalysisFailed;
+        auto result = call(*method, *params, code);
+        if (notification) {
+            if (!result) {
+                llvm::consumeError(result.takeError());
+            }
+            return llvm::None;
         }
-        else if (func == SB_MEM_PORT_STREAM) {
-			std::cout << "SB_MEM_PORT_STREAM("
-                << "port = " << ExtractConstant(cs.getArgument(4)).getLimitedValue() << ", "
-                << "stride = " << ExtractConstant(cs.getArgument(1)).getLimitedValue() << ", "
-                << "access_size = " << ExtractConstant(cs.getArgument(2)).getLimitedValue() << ", "
-                << "nstrides = " << ExtractConstant(cs.getArgument(3)).getLimitedValue()
-                << ")" << std::endl;
-				
-			// number of elements = nstrides * access_size / 8
-			// ports are numbered starting at 1
-			
-			int port = ExtractConstant(cs.getArgument(4)).getLimitedValue();
-			int access_size = ExtractConstant(cs.getArgument(2)).getLimitedValue();
-			int nstrides = ExtractConstant(cs.getArgument(3)).getLimitedValue();
-			
-			state[nullptr].AddAtPort(port-1, nstrides * access_size / 8);
-			std::cout << state[nullptr] << '\n';
+        if (!result) {
+            return makeError(std::move(id), code,
+                             llvm::toString(result.takeError()));
         }
-        else if (func == SB_CONSTANT) {
-			std::cout << "SB_CONSTANT("
-                << "port = " << ExtractConstant(cs.getArgument(0)).getLimitedValue() << ", "
-                << "nelems = " << ExtractConstant(cs.getArgument(2)).getLimitedValue()
-                << ")" << std::endl;
-				
-			int port = ExtractConstant(cs.getArgument(0)).getLimitedValue();
-			int nelems = ExtractConstant(cs.getArgument(2)).getLimitedValue();
-			
-			
-			state[nullptr].AddAtPort(port-1, nelems);
-			std::cout << state[nullptr] << '\n';
+        return llvm::json::Value(llvm::json::Object{
+            {"jsonrpc", "2.0"},
+            {"id", std::move(id)},
+            {"result", std::move(*result)}});
+    }
+
+    llvm::Expected<llvm::json::Value>
+    call(llvm::StringRef method, const llvm::json::Object& params, int& code) {
+        if (method == "shutdown") {
+            done = true;
+            return nullptr;
+        }
+        if (method != "load" && method != "waits" && method != "unload") {
+            code = MethodNotFound;
+            return fail("Unknown method " + method + ".");
+        }
+        auto path = params.getString("module");
+        if (!path) {
+            code = InvalidParams;
+            return fail("Missing module.");
+        }
+
+        if (method == "unload") {
+            modules.erase(*path);
+            caches.erase(*path);
+            return nullptr;
         }
-        else if (func == SB_PORT_MEM_STREAM) {
-			std::cout << "SB_PORT_MEM_STREAM("
-                << "port = " << ExtractConstant(cs.getArgument(0)).getLimitedValue() << ", "
-                << "stride = " << ExtractConstant(cs.getArgument(1)).getLimitedValue() << ", "
-                << "access_size = " << ExtractConstant(cs.getArgument(2)).getLimitedValue() << ", "
-                << "nstrides = " << ExtractConstant(cs.getArgument(3)).getLimitedValue()
-                << ")" << std::endl;
-				
-			// number of elements = nstrides * access_size / 8
-			// ports are numbered starting at 1
-			
-			int port = ExtractConstant(cs.getArgument(0)).getLimitedValue();
-			int access_size = ExtractConstant(cs.getArgument(2)).getLimitedValue();
-			int nstrides = ExtractConstant(cs.getArgument(3)).getLimitedValue();
-			
-			state[nullptr].AddAtPort(port-1, nstrides * access_size / 8);
-			std::cout << state[nullptr] << '\n';
+
+        if (method == "waits") {
+            auto found = modules.find(*path);
+            ServedModule* served = nullptr;
+            if (found != modules.end()) {
+                served = found->second.get();
+            } else {
+                auto loaded = load(*path);
+                if (!loaded) {
+                    return loaded.takeError();
+                }
+                served = modules[*path].get();
+            }
+            auto function = params.getString("function");
+            llvm::json::Array waits;
+            for (auto& result : served->analysis->waits) {
+                auto name = result.wait->getFunction()->getName();
+                if (function && name != *function) {
+                    continue;
+                }
+                unsigned line = 0;
+                if (auto& location = result.wait->getDebugLoc()) {
+                    line = location.getLine();
+                }
+                waits.push_back(llvm::json::Object{
+                    {"function", name.str()},
+                    {"line", line},
+                    {"verdict", verdictName(result.verdict)}});
+            }
+            return llvm::json::Value(std::move(waits));
+        }
+
+        return load(*path);
+    }
+
+    static llvm::Error
+    fail(const llvm::Twine& message) {
+        return llvm::make_error<llvm::StringError>(message,
+            llvm::inconvertibleErrorCode());
+    }
+
+    // (Re)loads and analyzes the module at `path` unless the file is
+    // unchanged since it was last loaded.
+    llvm::Expected<llvm::json::Value>
+    load(llvm::StringRef path) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            return fail("Unable to read " + path + ": "
+                        + buffer.getError().message());
+        }
+        llvm::MD5 md5;
+        md5.update((*buffer)->getBuffer());
+        llvm::MD5::MD5Result digest;
+        md5.final(digest);
+
+        auto* cache = directory;
+        if (!cache) {
+            auto& memory = caches[path];
+            if (!memory) {
+                memory = std::make_unique<analysis::ResultCache>("", salt,
+                    std::size_t(server_cache_size) << 20);
+            }
+            cache = memory.get();
         }
-        else if (func == SB_DISCARD) {
-			std::cout << "SB_DISCARD("
-                << "port = " << ExtractConstant(cs.getArgument(0)).getLimitedValue() << ", "
-                << "nelems = " << ExtractConstant(cs.getArgument(1)).getLimitedValue()
-                << ")" << std::endl;
-				
-			int port = ExtractConstant(cs.getArgument(0)).getLimitedValue();
-			int nelems = ExtractConstant(cs.getArgument(1)).getLimitedValue();
-			
-			state[nullptr].AddAtPort(port-1, nelems);
-			std::cout << state[nullptr] << '\n';
+
+        auto& served = modules[path];
+        bool changed = !served || !(served->digest == digest);
+        uint64_t hits = cache->hits;
+        uint64_t misses = cache->misses;
+        if (changed) {
+            if (!served) {
+                served = std::make_unique<ServedModule>();
+            }
+            // The old analysis refers to the old module, which is replaced
+            // together with its context.
+            served->analysis.reset();
+            served->module.reset();
+            served->context = std::make_unique<llvm::LLVMContext>();
+
+            SMDiagnostic err;
+            served->module = softbrain::loadKernelModule(std::move(*buffer),
+                entry_names, err, *served->context);
+            if (!served->module) {
+                std::string message;
+                llvm::raw_string_ostream out{message};
+                err.print("", out, false);
+                modules.erase(path);
+                return fail(out.str());
+            }
+            auto entry_points = findEntryPoints(*served->module);
+            if (!entry_points) {
+                modules.erase(path);
+                return entry_points.takeError();
+            }
+            if (auto error = checkPorts(*served->module)) {
+                modules.erase(path);
+                return error;
+            }
+
+            served->analysis = std::make_unique<ModuleAnalysis>(
+                *served->module, (unsigned)num_ports, nullptr, nullptr, cache);
+            analyze(*served->analysis, *entry_points);
+            served->digest = digest;
         }
+
+        return llvm::json::Value(llvm::json::Object{
+            {"module", path.str()},
+            {"changed", changed},
+            {"waits", int64_t(served->analysis->waits.size())},
+            {"solved", int64_t(cache->misses - misses)},
+            {"reused", int64_t(cache->hits - hits)}});
     }
 };
 
-static const llvm::Function *
-getCalledFunction(const llvm::CallSite cs) {
-	if (!cs.getInstruction()) {
-		return nullptr;
-	}
+// Exports the trace once the analysis is done, so that no formatting or
+// I/O happens while solving.
+static void
+writeTrace(const analysis::Tracer& tracer) {
+    std::string path = trace_output;
+    if (path.empty()) {
+        path = trace_format == TraceFormat::Chrome ? "trace.json" : "trace.bin";
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream out{path, ec, llvm::sys::fs::OF_None};
+    if (ec) {
+        llvm::report_fatal_error(llvm::Twine{"Unable to write trace "}
+            + path + ": " + ec.message());
+    }
 
-	const llvm::Value *called = cs.getCalledValue()->stripPointerCasts();
-	return llvm::dyn_cast<llvm::Function>(called);
+    switch (trace_format) {
+    case TraceFormat::Chrome:
+        tracer.writeChromeJson(out);
+        break;
+    case TraceFormat::Binary:
+        tracer.writeBinary(out);
+        break;
+    }
+}
+
+static llvm::json::Object
+timerToJSON(const llvm::Timer& timer) {
+    auto time = timer.getTotalTime();
+    return llvm::json::Object{
+        {"wall", time.getWallTime()},
+        {"user", time.getUserTime()},
+        {"system", time.getSystemTime()}};
 }
 
+// Prints the timer report and the counters to stderr, or with --stats-output
+// writes them as one JSON object:
+//
+//     {"module": ..., "ports": ..., "domain": ...,
+//      "timers": {"parse": {"wall": ..., "user": ..., "system": ...}, ...},
+//      "counters": {"contexts": ..., ...}}
+//
+// Times are in seconds.
 static void
-printWaitBalance(AssignmentSetResult& functionResults) {
-	for (auto& [value,localState] : functionResults) {
-		auto* inst = llvm::dyn_cast<llvm::Instruction>(value);
-		if (!inst) {
-		  continue;
-		}
-		
-		auto* called = getCalledFunction(llvm::CallSite{inst});
-		
-		if (called == nullptr) {
-			continue;
-		}
-		
-		auto fnName = called->getName();
-		
-		if (fnName == "SB_WAIT") {
-			llvm::outs() << fnName << '\n';	
-			if (localState[nullptr].isBalanced()) {
-				llvm::outs().changeColor(raw_ostream::Colors::GREEN);
-				std::cout << "Balanced\n\n";
-			}
-			else if (localState[nullptr].hasBalanced()) {
-				llvm::outs().changeColor(raw_ostream::Colors::YELLOW);
-				std::cout << "Maybe balanced\n\n";
-			}
-			else {
-				llvm::outs().changeColor(raw_ostream::Colors::RED);
-				std::cout << "Not balanced\n\n";
-			}
-		}
-	}
+reportStatistics(Statistics& stats, const analysis::ResultCache * cache) {
+    auto& solver = stats.solver;
+    uint64_t blocks = solver.blocks;
+    double mean_visits = blocks ? double(solver.blockVisits) / blocks : 0.0;
+
+    struct Counter {
+        const char * name;
+        const char * description;
+        llvm::json::Value value;
+    };
+    std::vector<Counter> counters = {
+        {"contexts", "(context, function) pairs analyzed", stats.contexts},
+        {"summarized-loops", "Loops applied at their exit in closed form",
+            stats.loops},
+        {"solves", "Items solved, counting reruns", uint64_t(solver.solves)},
+        {"block-visits", "Blocks visited", uint64_t(solver.blockVisits)},
+        {"mean-block-visits", "Mean visits per block and solve", mean_visits},
+        {"max-block-visits", "Most visits of one block in one solve",
+            uint64_t(solver.maxBlockVisits)},
+        {"transfer-calls", "Instructions interpreted by the transfer",
+            uint64_t(solver.transferCalls)},
+        {"peak-state-size", "Largest state (assignments in a set, counters "
+            "of an affine assignment, finite bounds of a DBM)",
+            uint64_t(solver.peakValueSize)},
+    };
+    if (cache) {
+        counters.push_back({"cache-hits", "Items whose cached results were "
+            "reused", uint64_t(cache->hits)});
+        counters.push_back({"cache-misses", "Items that were looked up in the "
+            "cache and solved", uint64_t(cache->misses)});
+        counters.push_back({"cache-stores", "Results written to the cache",
+            uint64_t(cache->stores)});
+    }
+
+    if (stats_output.empty()) {
+        stats.group.print(llvm::errs());
+        llvm::errs() << "===" << std::string(73, '-') << "===\n"
+                     << std::string(28, ' ') << "Balance analyzer counters\n"
+                     << "===" << std::string(73, '-') << "===\n\n";
+        for (auto& counter : counters) {
+            llvm::errs() << llvm::formatv("{0,14} {1} - {2}\n",
+                counter.value, counter.name, counter.description);
+        }
+    } else {
+        llvm::json::Object timers{
+            {"parse", timerToJSON(stats.parse)},
+            {"solve", timerToJSON(stats.solve)},
+            {"print", timerToJSON(stats.print)}};
+        llvm::json::Object counterValues;
+        for (auto& counter : counters) {
+            counterValues[counter.name] = counter.value;
+        }
+
+        std::error_code ec;
+        llvm::raw_fd_ostream out{stats_output, ec, llvm::sys::fs::OF_None};
+        if (ec) {
+            llvm::report_fatal_error(llvm::Twine{"Unable to write statistics "}
+                + stats_output + ": " + ec.message());
+        }
+        llvm::json::Object report{
+            {"module", input_path.getValue()},
+            {"ports", int(num_ports)},
+            {"domain", domainName(domain)},
+            {"timers", std::move(timers)},
+            {"counters", std::move(counterValues)}};
+        out << llvm::formatv("{0:2}", llvm::json::Value(std::move(report)))
+            << '\n';
+    }
+
+    // Timers that are still marked as triggered would be reported again when
+    // the group is destroyed.
+    stats.parse.clear();
+    stats.solve.clear();
+    stats.print.clear();
 }
 
 int main(int argc, char **argv) {
@@ -372,10 +974,53 @@ int main(int argc, char **argv) {
     cl::HideUnrelatedOptions(balance_cat);
     cl::ParseCommandLineOptions(argc, argv);
 
+    if (num_ports < 1 || num_ports > (int)kMaxPorts) {
+        llvm::report_fatal_error("Number of ports must be between 1 and "
+            + llvm::Twine(kMaxPorts) + ".");
+    }
+
+    if (entry_names.empty()) {
+        entry_names.push_back("main");
+    }
+
+    // Everything the results depend on besides the IR is part of the salt.
+    std::string salt = llvm::formatv(
+        "balance-analyzer {0} ports={1} domain={2} context-depth={3} "
+        "widening-delay={4} narrowing-passes={5} max-assignments={6} "
+        "summarize-loops={7}",
+        analysis::kResultCacheVersion, (int)num_ports, domainName(domain),
+        (unsigned)context_depth, (unsigned)widening_delay,
+        (unsigned)narrowing_passes, (unsigned)max_assignments,
+        (bool)summarize_loops).str();
+    std::unique_ptr<analysis::ResultCache> cache;
+    if (!cache_dir.empty()) {
+        cache = std::make_unique<analysis::ResultCache>(cache_dir, salt);
+    }
+
+    if (batch_mode) {
+        return runBatch(argv[0], cache.get());
+    }
+    if (server_mode) {
+        Server server{cache.get(), std::move(salt)};
+        // The input module is loaded before the first request.
+        server.preload(input_path);
+        return server.run();
+    }
+
+    std::unique_ptr<Statistics> statistics;
+    if (llvm::AreStatisticsEnabled()) {
+        statistics = std::make_unique<Statistics>();
+    }
+
     // Construct an IR file from the filename passed on the command line.
     SMDiagnostic err;
     LLVMContext context;
-    std::unique_ptr<Module> module = llvm::parseIRFile(input_path.getValue(), err, context);
+    std::unique_ptr<Module> module;
+    {
+        llvm::TimeRegion timing{statistics ? &statistics->parse : nullptr};
+        module = softbrain::loadKernelModule(input_path.getValue(),
+                                             entry_names, err, context);
+    }
 
     if (!module.get()) {
         errs() << "Error reading bitcode file: " << input_path << "\n";
@@ -383,31 +1028,34 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    auto * main_func = module->getFunction("main");
-
-    if (!main_func) {
-        llvm::report_fatal_error("Unable to find main function.");
+    auto entry_points = findEntryPoints(*module);
+    if (!entry_points) {
+        llvm::report_fatal_error(entry_points.takeError());
+    }
+    if (auto error = checkPorts(*module)) {
+        errs() << input_path << ": " << llvm::toString(std::move(error))
+            << "\n";
+        return -1;
     }
 
-    SB_CONFIG = module->getFunction("SB_CONFIG");
-    SB_WAIT = module->getFunction("SB_WAIT");
-    SB_MEM_PORT_STREAM = module->getFunction("SB_MEM_PORT_STREAM");
-    SB_CONSTANT = module->getFunction("SB_CONSTANT");
-    SB_PORT_MEM_STREAM = module->getFunction("SB_PORT_MEM_STREAM");
-    SB_DISCARD = module->getFunction("SB_DISCARD");
+    std::unique_ptr<analysis::Tracer> tracer;
+    if (trace_level != analysis::TraceLevel::Off) {
+        tracer = std::make_unique<analysis::Tracer>(trace_level, trace_buffer);
+    }
 
+    ModuleAnalysis ma{*module, (unsigned)num_ports, tracer.get(),
+                      statistics.get(), cache.get()};
+    analyze(ma, *entry_points);
+    {
+        llvm::TimeRegion timing{statistics ? &statistics->print : nullptr};
+        printWaitBalance(ma);
+    }
 
-    using Value    = AssignmentSet;
-    using Transfer = AssignmentSetExtend;
-    using Meet     = AssignmentSetCombine;
-    using Analysis = analysis::DataflowAnalysis<Value, Transfer, Meet>;
-    Analysis analysis{*module, main_func};
-    auto results = analysis.computeDataflow();
-	
-    for (auto& [context, contextResults] : results) {
-        for (auto& [function, functionResults] : contextResults) {
-			printWaitBalance(functionResults);
-        }
+    if (tracer) {
+        writeTrace(*tracer);
+    }
+    if (statistics) {
+        reportStatistics(*statistics, cache.get());
     }
 
     return 0;
@@ -0,0 +1,587 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+
+#include "dfa.h"
+
+// The assignment domain is instantiated once per supported port count so that
+// every PortAssignment is a fixed-width, inline std::array and the hot
+// normalize / compare / add loops have a compile-time trip count.
+constexpr unsigned kMaxPorts = 16;
+
+template <unsigned NumPorts>
+struct PortAssignment {
+    static_assert(NumPorts > 0 && NumPorts <= kMaxPorts,
+        "unsupported number of ports");
+
+    std::array<int, NumPorts> port_values;
+
+    // Invariant: PortAssignments are always guaranteed to be in "normal form"
+    // (I.e. at least one value is 0).
+
+    PortAssignment(const std::array<int, NumPorts>& _port_values)
+        : port_values(_port_values) {
+
+        int min = port_values[0];
+        for (unsigned i = 1; i < NumPorts; i++) {
+            min = std::min(min, port_values[i]);
+        }
+        for (int& i : port_values) {
+            i -= min;
+        }
+    }
+
+    static PortAssignment Zero() {
+        return PortAssignment(std::array<int, NumPorts>{});
+    }
+
+    bool operator==(const PortAssignment& other) const {
+        return port_values == other.port_values;
+    }
+
+    std::size_t hash() const {
+        return llvm::hash_combine_range(port_values.begin(), port_values.end());
+    }
+
+    bool Balanced() const {
+        // Only need to check against 0 since the only normal form balanced
+        // assignment is <0, 0, ...>
+        for (int i : port_values) {
+            if (i != 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    const PortAssignment AddAtPort(int portNum, int value) const {
+        std::array<int, NumPorts> copy = port_values;
+        copy[portNum] += value;
+
+        return PortAssignment(copy);
+    }
+
+    bool isBalanced() const {
+        return (*std::max_element(port_values.begin(), port_values.end()) == 0);
+    }
+};
+
+template <unsigned NumPorts>
+std::ostream& operator<<(std::ostream& os, const PortAssignment<NumPorts>& p) {
+    os << '<';
+
+    for (unsigned i = 0; i < NumPorts; i++) {
+        if (i > 0) {
+            os << ", ";
+        }
+        os << p.port_values[i];
+    }
+    os << '>';
+
+    return os;
+}
+
+namespace std {
+
+    template <unsigned NumPorts>
+    struct hash<PortAssignment<NumPorts>> {
+        std::size_t operator()(const PortAssignment<NumPorts>& k) const {
+            return k.hash();
+        }
+    };
+
+}
+
+// Every distinct normalized PortAssignment is hash-consed into this table and
+// referred to by a compact integer id everywhere else. Two assignments are
+// equal iff their ids are equal, so sets of assignments only ever compare,
+// hash and copy integers.
+//
+// The table is shared by all threads of a parallel analysis. Lookups of
+// already known results take a shared lock; only the first occurrence of an
+// assignment or of an AddAtPort step takes the exclusive one.
+//
+// Ids are only valid while the table is in use. Every analysis holds a Use
+// of the table for as long as it has sets of assignments, and the table is
+// cleared when the last Use ends, so that a long-running process does not
+// keep every assignment it has ever seen.
+using AssignmentId = unsigned;
+
+template <unsigned NumPorts>
+class PortAssignmentTable {
+public:
+    using Assignment = PortAssignment<NumPorts>;
+
+    // The balanced assignment <0, 0, ...> is interned first, so it is always
+    // id 0 and balance checks never need to consult the table.
+    static constexpr AssignmentId kBalanced = 0;
+
+    PortAssignmentTable() {
+        Intern(Assignment::Zero());
+    }
+
+    static PortAssignmentTable& Global() {
+        static PortAssignmentTable table;
+        return table;
+    }
+
+    class Use {
+    public:
+        Use() : table(Global()) {
+            std::unique_lock<std::shared_mutex> writer{table.lock};
+            ++table.users;
+        }
+
+        ~Use() {
+            std::unique_lock<std::shared_mutex> writer{table.lock};
+            if (--table.users == 0) {
+                table.ClearLocked();
+            }
+        }
+
+        Use(const Use&) = delete;
+        Use& operator=(const Use&) = delete;
+
+    private:
+        PortAssignmentTable& table;
+    };
+
+    AssignmentId Intern(const Assignment& p) {
+        {
+            std::shared_lock<std::shared_mutex> reader{lock};
+            auto found = ids.find(p);
+            if (found != ids.end()) {
+                return found->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> writer{lock};
+        return InternLocked(p);
+    }
+
+    Assignment Get(AssignmentId id) const {
+        std::shared_lock<std::shared_mutex> reader{lock};
+        return assignments[id];
+    }
+
+    // AddAtPort is memoized on (id, port, value) since the same stream
+    // command is re-applied to the same assignments on every fixpoint visit.
+    AssignmentId AddAtPort(AssignmentId id, int portNum, int value) {
+        std::pair<AssignmentId, std::pair<int, int>> key{id, {portNum, value}};
+        {
+            std::shared_lock<std::shared_mutex> reader{lock};
+            auto found = add_cache.find(key);
+            if (found != add_cache.end()) {
+                return found->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> writer{lock};
+        auto [found, inserted] = add_cache.insert({key, 0});
+        if (inserted) {
+            found->second =
+                InternLocked(assignments[id].AddAtPort(portNum, value));
+        }
+        return found->second;
+    }
+
+    std::size_t size() const {
+        std::shared_lock<std::shared_mutex> reader{lock};
+        return assignments.size();
+    }
+
+private:
+    mutable std::shared_mutex lock;
+    std::vector<Assignment> assignments;
+    std::unordered_map<Assignment, AssignmentId> ids;
+    llvm::DenseMap<std::pair<AssignmentId, std::pair<int, int>>, AssignmentId>
+        add_cache;
+    unsigned users = 0;
+
+    void ClearLocked() {
+        // Release the memory, too, not just the elements.
+        std::vector<Assignment>().swap(assignments);
+        decltype(ids)().swap(ids);
+        add_cache.shrink_and_clear();
+        InternLocked(Assignment::Zero());
+    }
+
+    AssignmentId InternLocked(const Assignment& p) {
+        auto [found, inserted] = ids.insert({p, assignments.size()});
+        if (inserted) {
+            assignments.push_back(p);
+        }
+        return found->second;
+    }
+};
+
+// An over-approximation of a set of PortAssignments by one interval of
+// normalized values per port. The bounds are exact for the assignments they
+// summarize, but the assignments inside the bounds are not known, so a hull
+// can only tell that every assignment is balanced (all upper bounds are 0)
+// or that none is (some lower bound is above 0).
+template <unsigned NumPorts>
+struct PortHull {
+    std::array<int, NumPorts> lower;
+    std::array<int, NumPorts> upper;
+
+    static PortHull Of(const PortAssignment<NumPorts>& p) {
+        return PortHull{p.port_values, p.port_values};
+    }
+
+    PortHull Join(const PortHull& other) const {
+        PortHull joined;
+        for (unsigned i = 0; i < NumPorts; i++) {
+            joined.lower[i] = std::min(lower[i], other.lower[i]);
+            joined.upper[i] = std::max(upper[i], other.upper[i]);
+        }
+        return joined;
+    }
+
+    bool operator==(const PortHull& other) const {
+        return lower == other.lower && upper == other.upper;
+    }
+
+    // Adding `value` at a port and normalizing again subtracts the new
+    // minimum from every port. That minimum lies between 0 and `value`.
+    PortHull AddAtPort(int portNum, int value) const {
+        int low_shift = std::min(0, value);
+        int high_shift = std::max(0, value);
+        PortHull added;
+        for (unsigned i = 0; i < NumPorts; i++) {
+            int l = lower[i];
+            int u = upper[i];
+            if ((int)i == portNum) {
+                l += value;
+                u += value;
+            }
+            added.lower[i] = std::max(0, l - high_shift);
+            added.upper[i] = std::max(0, u - low_shift);
+        }
+        return added;
+    }
+
+    bool isBalanced() const {
+        return *std::max_element(upper.begin(), upper.end()) == 0;
+    }
+
+    bool hasBalanced() const {
+        return *std::max_element(lower.begin(), lower.end()) == 0;
+    }
+};
+
+template <unsigned NumPorts>
+struct AssignmentSet {
+    using Table = PortAssignmentTable<NumPorts>;
+    using Hull = PortHull<NumPorts>;
+    static constexpr unsigned kNumPorts = NumPorts;
+    static constexpr bool kSingleFact = true;
+
+    // Sorted, duplicate-free ids of interned PortAssignments.
+    std::vector<AssignmentId> assignments;
+
+    // An unbounded set stands for every possible assignment. It is only
+    // produced by widening, when a loop keeps adding new assignments.
+    bool unbounded = false;
+
+    // A set that would enumerate too many assignments is summarized by their
+    // hull instead and enumerates none (see AssignmentSetCombine). Hulls are
+    // shared between the copies of a set, like the states that hold them.
+    std::shared_ptr<const Hull> hull;
+
+    AssignmentSet() { }
+
+    AssignmentSet(std::vector<AssignmentId>&& _assignments)
+        : assignments(std::move(_assignments)) { }
+
+    static AssignmentSet Of(const PortAssignment<NumPorts>& p) {
+        return AssignmentSet({Table::Global().Intern(p)});
+    }
+
+    // The state right after an SB_CONFIG: all ports are empty.
+    static AssignmentSet Configured() {
+        return Of(PortAssignment<NumPorts>::Zero());
+    }
+
+    static AssignmentSet Any() {
+        AssignmentSet any;
+        any.unbounded = true;
+        return any;
+    }
+
+    static AssignmentSet Summarized(const Hull& h) {
+        AssignmentSet summarized;
+        summarized.hull = std::make_shared<const Hull>(h);
+        return summarized;
+    }
+
+    AssignmentSet operator+(const AssignmentSet& other) const {
+        if (unbounded || other.unbounded) {
+            return Any();
+        }
+        if (hull || other.hull) {
+            std::optional<Hull> joined;
+            JoinInto(joined);
+            other.JoinInto(joined);
+            return Summarized(*joined);
+        }
+
+        std::vector<AssignmentId> new_assignments;
+        new_assignments.reserve(assignments.size() + other.assignments.size());
+
+        std::set_union(
+            assignments.begin(), assignments.end(),
+            other.assignments.begin(), other.assignments.end(),
+            std::back_inserter(new_assignments));
+
+        return AssignmentSet(std::move(new_assignments));
+    }
+
+    // The hull of the set, which enumerates no assignments.
+    AssignmentSet Summarize() const {
+        if (unbounded || hull) {
+            return *this;
+        }
+        std::optional<Hull> summary;
+        JoinInto(summary);
+        return summary ? Summarized(*summary) : *this;
+    }
+
+    bool operator==(const AssignmentSet& other) const {
+        if (unbounded != other.unbounded
+            || assignments != other.assignments) {
+            return false;
+        }
+        if (hull == other.hull) {
+            return true;
+        }
+        return hull && other.hull && *hull == *other.hull;
+    }
+
+    // The number of enumerated assignments. An unbounded set enumerates none.
+    std::size_t Size() const {
+        return assignments.size();
+    }
+
+    bool AlwaysBalanced() const {
+        if (hull) {
+            return hull->isBalanced();
+        }
+        return !unbounded
+            && assignments.size() == 1
+            && assignments.front() == Table::kBalanced;
+    }
+
+    void AddAtPort(int portNum, int value) {
+        if (hull) {
+            hull = std::make_shared<const Hull>(hull->AddAtPort(portNum, value));
+            return;
+        }
+        Table& table = Table::Global();
+        for (AssignmentId& id : assignments) {
+            id = table.AddAtPort(id, portNum, value);
+        }
+        // Distinct assignments can collapse onto the same normal form.
+        std::sort(assignments.begin(), assignments.end());
+        assignments.erase(
+            std::unique(assignments.begin(), assignments.end()),
+            assignments.end());
+    }
+
+    // A count that is not known could be added to any of the assignments, and
+    // a hull cannot bound it, so the set becomes unbounded.
+    void AddUnknownAtPort(int /*portNum*/) {
+        *this = Any();
+    }
+
+    bool isBalanced() const {
+        if (unbounded) {
+            return false;
+        }
+        if (hull) {
+            return hull->isBalanced();
+        }
+        return std::all_of(assignments.begin(), assignments.end(),
+            [] (AssignmentId id) { return id == Table::kBalanced; });
+    }
+
+    bool hasBalanced() const {
+        if (unbounded) {
+            return true;
+        }
+        if (hull) {
+            return hull->hasBalanced();
+        }
+        return !assignments.empty()
+            && assignments.front() == Table::kBalanced;
+    }
+
+    // Ids are only meaningful within one run, so cached sets hold the
+    // assignments themselves and are interned again when they are read. The
+    // order of the ids depends on when the assignments were interned, so the
+    // assignments are written sorted by their values instead, which makes
+    // the encoding of a set, e.g. in a cache key, the same in every run.
+    void encode(analysis::CacheWriter& out) const {
+        auto& table = Table::Global();
+        std::vector<std::array<int, NumPorts>> values;
+        values.reserve(assignments.size());
+        for (AssignmentId id : assignments) {
+            values.push_back(table.Get(id).port_values);
+        }
+        std::sort(values.begin(), values.end());
+
+        out.write(unbounded);
+        out.write(hull != nullptr);
+        if (hull) {
+            for (int value : hull->lower) {
+                out.write(value);
+            }
+            for (int value : hull->upper) {
+                out.write(value);
+            }
+        }
+        out.write(values.size());
+        for (auto& assignment : values) {
+            for (int value : assignment) {
+                out.write(value);
+            }
+        }
+    }
+
+    static bool decode(analysis::CacheReader& in, AssignmentSet& set) {
+        int64_t unbounded, summarized, size;
+        if (!in.read(unbounded) || !in.read(summarized)) {
+            return false;
+        }
+        set.unbounded = unbounded;
+        set.hull = nullptr;
+        if (summarized) {
+            Hull h;
+            for (auto* bounds : {&h.lower, &h.upper}) {
+                for (int& value : *bounds) {
+                    int64_t read;
+                    if (!in.read(read)) {
+                        return false;
+                    }
+                    value = read;
+                }
+            }
+            set.hull = std::make_shared<const Hull>(h);
+        }
+        if (!in.read(size) || size < 0) {
+            return false;
+        }
+        set.assignments.clear();
+        for (int64_t i = 0; i < size; i++) {
+            std::array<int, NumPorts> values;
+            for (int& value : values) {
+                int64_t read;
+                if (!in.read(read)) {
+                    return false;
+                }
+                value = read;
+            }
+            set.assignments.push_back(
+                Table::Global().Intern(PortAssignment<NumPorts>(values)));
+        }
+        std::sort(set.assignments.begin(), set.assignments.end());
+        return true;
+    }
+
+private:
+    // Joins the hull of this set into `joined`, which is empty to start with.
+    void JoinInto(std::optional<Hull>& joined) const {
+        auto add = [&joined] (const Hull& h) {
+            joined = joined ? joined->Join(h) : h;
+        };
+        if (hull) {
+            add(*hull);
+        }
+        Table& table = Table::Global();
+        for (AssignmentId id : assignments) {
+            add(Hull::Of(table.Get(id)));
+        }
+    }
+};
+
+template <unsigned NumPorts>
+std::ostream& operator<<(std::ostream& os, const AssignmentSet<NumPorts>& a) {
+    if (a.unbounded) {
+        return os << "<any>\n";
+    }
+    if (a.hull) {
+        os << '<';
+        for (unsigned i = 0; i < NumPorts; i++) {
+            if (i > 0) {
+                os << ", ";
+            }
+            os << a.hull->lower[i] << ".." << a.hull->upper[i];
+        }
+        return os << ">\n";
+    }
+
+    auto& table = PortAssignmentTable<NumPorts>::Global();
+    for (AssignmentId id : a.assignments) {
+        os << table.Get(id) << '\n';
+    }
+
+    return os;
+}
+
+// A set that would enumerate more than `maxAssignments` assignments, unless
+// that is 0, is summarized by a PortHull.
+template <unsigned NumPorts>
+class AssignmentSetCombine
+    : public analysis::Meet<AssignmentSet<NumPorts>,
+                            AssignmentSetCombine<NumPorts>> {
+public:
+    explicit AssignmentSetCombine(unsigned maxAssignments = 0)
+        : maxAssignments(maxAssignments) { }
+
+    AssignmentSet<NumPorts>
+    meetPair(AssignmentSet<NumPorts>& s1, AssignmentSet<NumPorts>& s2) const {
+        auto joined = s1 + s2;
+        if (maxAssignments && joined.Size() > maxAssignments) {
+            return joined.Summarize();
+        }
+        return joined;
+    }
+
+private:
+    unsigned maxAssignments;
+};
+
+// Sets of assignments only grow around a loop that streams an unbalanced
+// number of elements per iteration, so widening gives up on enumerating them.
+template <unsigned NumPorts>
+class AssignmentSetWiden
+    : public analysis::Widening<AssignmentSet<NumPorts>,
+                                AssignmentSetWiden<NumPorts>> {
+public:
+    using analysis::Widening<AssignmentSet<NumPorts>,
+                             AssignmentSetWiden<NumPorts>>::Widening;
+
+    AssignmentSet<NumPorts>
+    widenPair(const AssignmentSet<NumPorts>& /*older*/,
+              const AssignmentSet<NumPorts>& /*newer*/) const {
+        return AssignmentSet<NumPorts>::Any();
+    }
+
+    AssignmentSet<NumPorts>
+    narrowPair(const AssignmentSet<NumPorts>& older,
+               const AssignmentSet<NumPorts>& newer) const {
+        return older.unbounded ? newer : older;
+    }
+};
@@ -0,0 +1,20 @@
+#include "softbrain.h"
+
+// The entry point streams nothing, and neither does the helper it calls, so
+// there is nothing for the analysis to report. It must still analyze main
+// rather than trip over it once the kernel loader has dropped every function
+// that cannot reach an SB_* intrinsic.
+
+static int sum(const int * arr, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        total += arr[i];
+    }
+    return total;
+}
+
+int main() {
+    int arr[4] = {1, 2, 3, 4};
+
+    return sum(arr, 4) == 10 ? 0 : 1;
+}